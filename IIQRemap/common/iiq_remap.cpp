@@ -26,12 +26,14 @@
 #include "about.h"
 
 #include <QAbstractSlider>
+#include <QAction>
 #include <QColorDialog>
 #include <QDesktopServices>
 #include <QDoubleSpinBox>
 #include <QDir>
 #include <QFile>
 #include <QFileDialog>
+#include <QKeySequence>
 #include <QPalette>
 #include <QProgressDialog>
 #include <QProxyStyle>
@@ -61,8 +63,6 @@
 
 #define STATE_SECTION "Saved State"
 
-#define MAX_RAWS  7
-
 #if defined( Q_OS_MACOS )
 #define BUNDLE_ID CFSTR("IIQRemap")
 #if defined(_QT_STATIC_) && QT_VERSION >= 0x060000
@@ -170,7 +170,11 @@ inline uint16_t blockSize(int index) { return uint16_t((index<<1)+4); }
 IIQRemap::IIQRemap()
     : QMainWindow(), scale(1),
       lockModeChange(false), lockThresChange(false),
-      overrideCursorSet(false)
+      overrideCursorSet(false),
+      rawLoader(0), regionLoader(0), rawCursor(-1, -1), loadProgress(0),
+      rawPrefetcher(0), rawStep(1),
+      rawModified{0, 0},
+      thumbBrowser(0)
 {
     curRawPath = "./";
 
@@ -258,9 +262,12 @@ IIQRemap::IIQRemap()
     connect(ui.actionDiscard_changes, SIGNAL(triggered()), this, SLOT(discardChanges()));
     connect(ui.actionApplyToFiles, SIGNAL(triggered()), this, SLOT(applyToFiles()));
     connect(ui.actionLoad_raw, SIGNAL(triggered()), this, SLOT(loadRaw()));
+    connect(ui.actionNext_raw, SIGNAL(triggered()), this, SLOT(nextRaw()));
+    connect(ui.actionPrev_raw, SIGNAL(triggered()), this, SLOT(prevRaw()));
     connect(ui.actionAuto_remap, SIGNAL(triggered()), this, SLOT(autoRemap()));
     connect(ui.actionHelp_web, SIGNAL(triggered()), this, SLOT(help()));
     connect(ui.actionAbout, SIGNAL(triggered()), this, SLOT(about()));
+    connect(ui.actionCorr_stats, SIGNAL(toggled(bool)), this, SLOT(showCorrStats(bool)));
     connect(ui.actionQuit, SIGNAL(triggered()), this, SLOT(close()));
 
     // button group
@@ -271,10 +278,25 @@ IIQRemap::IIQRemap()
     setWindowTitle(MAIN_TITLE);
 
     // raw image events
+    connect(ui.rawScrollArea->horizontalScrollBar(), SIGNAL(valueChanged(int)),
+            ui.rawImage, SLOT(refreshOverlays()));
+    connect(ui.rawScrollArea->verticalScrollBar(), SIGNAL(valueChanged(int)),
+            ui.rawImage, SLOT(refreshOverlays()));
     connect(ui.rawImage, SIGNAL(imageCursorPosUpdated(uint16_t, uint16_t)),
             this,        SLOT(updateStatus(uint16_t, uint16_t)));
+    connect(ui.rawImage, SIGNAL(imageCursorPosUpdated(uint16_t, uint16_t)),
+            this,        SLOT(rawCursorMoved(uint16_t, uint16_t)));
     connect(ui.rawImage, SIGNAL(defectsChanged()), this, SLOT(defectsChanged()));
 
+    rawPrefetcher = new RawPrefetcher(this);
+
+    // file browser panel
+    thumbBrowser = new ThumbnailBrowser(this);
+    thumbBrowser->toggleViewAction()->setShortcut(QKeySequence(tr("Ctrl+B")));
+    addDockWidget(Qt::LeftDockWidgetArea, thumbBrowser);
+    ui.menuFile->insertAction(ui.actionOpen, thumbBrowser->toggleViewAction());
+    connect(thumbBrowser, SIGNAL(rawsActivated(QStringList)), this, SLOT(loadRaws(QStringList)));
+
     // init data
     init();
 
@@ -291,6 +313,11 @@ IIQRemap::IIQRemap()
     defectColour = settings.value("Defect Colour", defectColour).value<QColor>();
     ui.cbAdaptiveBlock->setCurrentIndex(settings.value("Adaptive Block", 14).toInt());
     ui.chkAdaptiveRemap->setCheckState(Qt::CheckState(settings.value("Adaptive Remap", Qt::Unchecked).toInt()));
+    rawPrefetcher->cache().setBudget(size_t(settings.value("Raw Cache MB", FRAME_CACHE_MB).toULongLong())<<20);
+    ui.rawImage->setDisplayCacheSize(size_t(settings.value("Display Cache MB", DISPLAY_CACHE_MB).toULongLong())<<20);
+    IIQFile::setDefaultFixedPointFlatField(settings.value("Fixed Point Flat Field", false).toBool());
+    thumbBrowser->setFolder(curRawPath);
+    thumbBrowser->setVisible(settings.value("File Browser", false).toBool());
 
     if (!pos.isNull())
         move(pos);
@@ -309,6 +336,9 @@ IIQRemap::IIQRemap()
 
 IIQRemap::~IIQRemap()
 {
+    cancelRawLoad();
+    rawPrefetcher->cancel();
+
     delete expControls[C_ALL];
     delete expControls[C_RED];
     delete expControls[C_GREEN];
@@ -357,9 +387,17 @@ void IIQRemap::closeEvent(QCloseEvent *event)
     settings.setValue("Defect Colour", defectColour);
     settings.setValue("Adaptive Remap", ui.chkAdaptiveRemap->checkState());
     settings.setValue("Adaptive Block", ui.cbAdaptiveBlock->currentIndex());
+    settings.setValue("Raw Cache MB", qulonglong(rawPrefetcher->cache().budget()>>20));
+    settings.setValue("Display Cache MB", qulonglong(ui.rawImage->displayCacheSize()>>20));
+    settings.setValue("Fixed Point Flat Field", IIQFile::defaultFixedPointFlatField());
+    settings.setValue("File Browser", thumbBrowser->isVisible());
 
     if (checkUnsavedAndSave())
+    {
+        cancelRawLoad();
+        rawPrefetcher->cancel();
         event->accept();
+    }
     else
         event->ignore();
 }
@@ -455,6 +493,8 @@ void IIQRemap::updateWidgets()
     ui.btnPointMode->setEnabled(hasCalFile);
 
     ui.btnLoadCal->setEnabled(hasRaw);
+    ui.actionNext_raw->setEnabled(!rawFileName.isEmpty());
+    ui.actionPrev_raw->setEnabled(!rawFileName.isEmpty());
     ui.btnSave->setEnabled(hasCalFile);
     ui.btnReset->setEnabled(hasCalFile);
     ui.btnApplyToFiles->setEnabled(hasCalFile);
@@ -756,10 +796,11 @@ void IIQRemap::sensorPlusSelected(int id)
         scale = fitScale(iiqFile->imgdata.sizes.raw_width,
                          iiqFile->imgdata.sizes.raw_height,
                          *ui.rawImage);
-    ui.rawImage->setSensorPlus(id, scale);
-
-    // process raw data to gather stats
-    processRawData();
+    // stats are kept unless the raw had to be corrected again
+    if (ui.rawImage->setSensorPlus(id, scale))
+        processRawData();
+    else
+        setRawStats(rawStats[id]);
     calculateThresholds();
 
     updateWidgets();
@@ -770,12 +811,15 @@ void IIQRemap::sensorPlusSelected(int id)
 
 void IIQRemap::loadRaw()
 {
-    auto fileNames = QFileDialog::getOpenFileNames(
-                        this,
-                        tr("Load Phase One .IIQ file(s)"),
-                        curRawPath,
-                        tr("Phase One IIQ (*.iiq *.tif *.tiff)"));
+    loadRaws(QFileDialog::getOpenFileNames(
+                this,
+                tr("Load Phase One .IIQ file(s)"),
+                curRawPath,
+                tr("Phase One IIQ (*.iiq *.tif *.tiff)")));
+}
 
+void IIQRemap::loadRaws(QStringList fileNames)
+{
     // filter through and leave only files
     auto it = fileNames.begin();
     while (it != fileNames.end())
@@ -794,208 +838,346 @@ void IIQRemap::loadRaw()
     }
     else if (fileNames.size() > 0)
     {
-        setOverrideCursor(QCursor(Qt::WaitCursor));
-        // read the first raw
         QFileInfo info(fileNames.at(0));
 		curRawPath = info.absolutePath();
 
-        auto iiqFile = std::make_unique<IIQFile>();
-        int ret = LIBRAW_SUCCESS;
-        if ((ret = iiqFile->open_file(TO_STDSTR(fileNames.at(0)).c_str())) != LIBRAW_SUCCESS)
-        {
-            showMessage(tr("Error"), tr("Error opening file\n%1!").arg(fileNames.at(0)));
-        }
-        else if (!iiqFile->isPhaseOne() || iiqFile->getPhaseOneSerial().empty())
-        {
-            ret = LIBRAW_FILE_UNSUPPORTED;
-            showMessage(tr("Error"), tr("File %1\ndoes not seem to be Phase One IIQ file!").arg(fileNames.at(0)));
-        }
-        else if ((ret = iiqFile->unpack()) != LIBRAW_SUCCESS)
+        rawStep = 1;
+        startRawLoad(fileNames);
+    }
+}
+
+void IIQRemap::nextRaw()
+{
+    stepRaw(1);
+}
+
+void IIQRemap::prevRaw()
+{
+    stepRaw(-1);
+}
+
+// Loads the raw next to the shown one (or the one being loaded) in
+// the same folder
+void IIQRemap::stepRaw(int step)
+{
+    const QString& fileName = rawLoader ? rawLoader->fileNames().at(0) : rawFileName;
+    if (fileName.isEmpty())
+        return;
+
+    auto fileNames = folderRaws(QFileInfo(fileName).absolutePath());
+    int index = fileNames.indexOf(QFileInfo(fileName).absoluteFilePath()) + step;
+
+    if (index >= 0 && index < fileNames.size())
+    {
+        rawStep = step;
+        startRawLoad(QStringList() << fileNames.at(index));
+    }
+}
+
+// Queues raws around the shown one in the direction of browsing
+void IIQRemap::prefetchRaws()
+{
+    QStringList prefetchFiles;
+    auto fileNames = folderRaws(QFileInfo(rawFileName).absolutePath());
+    int index = fileNames.indexOf(QFileInfo(rawFileName).absoluteFilePath());
+
+    if (index >= 0)
+        for (int step: { rawStep, -rawStep, 2*rawStep })
+            if (index+step >= 0 && index+step < fileNames.size())
+                prefetchFiles.append(fileNames.at(index+step));
+
+    rawPrefetcher->prefetch(prefetchFiles,
+                            ui.rawImage->getCalFile(),
+                            ui.rawImage->getDefectCorr());
+}
+
+// Loads raws in background - the current raw stays until the new
+// one is loaded and only the last requested load is kept
+void IIQRemap::startRawLoad(const QStringList& fileNames)
+{
+    cancelRawLoad();
+
+    RawLoader* loader = 0;
+    if (fileNames.size() == 1)
+    {
+        // prefetched raw is shown straight away
+        if (auto frame = rawPrefetcher->take(fileNames.at(0)))
         {
-            showMessage(tr("Error"), tr("Error unpacking IIQ data from file\n%1!").arg(fileNames.at(0)));
+            setRawFrame(*frame, LIBRAW_SUCCESS);
+            return;
         }
 
-        // check if we have multiple files and load up a stack
-        if (ret == LIBRAW_SUCCESS && fileNames.size() > 1)
-            ret = loadRawStack(*iiqFile, fileNames);
+        // or the one being prefetched is taken over
+        if ((loader = rawPrefetcher->takeLoader(fileNames.at(0))))
+            loader->setParent(this);
+    }
 
-        const auto& calFile = ui.rawImage->getCalFile();
-        if (ret == LIBRAW_SUCCESS && ui.rawImage->hasUnsavedChanges() &&
-            iiqFile->getPhaseOneSerial() != calFile.getCalSerial())
+    // new loads are shown progressively, taken over ones are well on the way
+    bool prefetched = loader != 0;
+    if (!prefetched)
+    {
+        loader = new RawLoader(fileNames,
+                               ui.rawImage->getCalFile(),
+                               ui.rawImage->getDefectCorr(),
+                               this);
+        loader->setPreview(ui.rawImage->renderParams());
+
+        // area under the cursor is shown at 1:1 before the full decode
+        if (fileNames.size() == 1)
         {
-            if (showMessage(tr("Warning"),
-                            tr("IIQ file %1\ndoes not match current calibration with unsaved changed!").arg(fileNames.at(0)),
-                            tr("Do you want to load IIQ file anyway?"),
-                            QMessageBox::Question,
-                            QMessageBox::Yes | QMessageBox::No,
-                            QMessageBox::Yes) == QMessageBox::No)
-                ret = LIBRAW_UNSPECIFIED_ERROR;
-            else
-            {
-                // reset mode
-                lockModeChange = true;
-                ui.btnPointMode->setChecked(false);
-                ui.btnColMode->setChecked(false);
-                lockModeChange = false;
-            }
+            regionLoader = new RegionLoader(fileNames.at(0),
+                                            ui.rawImage->getCalFile(),
+                                            ui.rawImage->getDefectCorr(),
+                                            ui.rawImage->renderParams(),
+                                            this);
+            regionLoader->setPosition(rawCursor.y(), rawCursor.x());
+            connect(regionLoader, SIGNAL(region(QImage,QRect)), this, SLOT(rawLoadRegion(QImage,QRect)));
+            regionLoader->start();
         }
+    }
 
-        // actually load the data into control
-        if (ret == LIBRAW_SUCCESS)
-        {
-            // it may have been reset by message window - set it again
-            setOverrideCursor(QCursor(Qt::WaitCursor));
+    rawLoader = loader;
+    connect(rawLoader, SIGNAL(progress(int,int,QString)), this, SLOT(rawLoadProgress(int,int,QString)));
+    connect(rawLoader, SIGNAL(preview(QImage,int,int)), this, SLOT(rawLoadPreview(QImage,int,int)));
+    connect(rawLoader, SIGNAL(finished()), this, SLOT(rawLoadFinished()));
 
-            // get WB
-            float* wb = iiqFile->imgdata.color.cam_mul;
+    // prefetch could finish before getting connected
+    if (prefetched && rawLoader->done())
+    {
+        finishRawLoad();
+        return;
+    }
 
-            if (wb[0] <= 0)
-                wb = iiqFile->imgdata.color.pre_mul;
+    loadProgress = new QProgressDialog(tr("Loading IIQ file..."), tr("Cancel"), 0, rawLoader->fileNames().size()+2, this);
+    loadProgress->setWindowModality(Qt::NonModal);
+    loadProgress->setMinimumDuration(500);
+    loadProgress->setAutoClose(false);
+    connect(loadProgress, SIGNAL(canceled()), this, SLOT(cancelRawLoad()));
 
-            camWB[C_RED]    = wb[C_RED];
-            camWB[C_GREEN]  = wb[C_GREEN];
-            camWB[C_BLUE]   = wb[C_BLUE];
-            camWB[C_GREEN2] = wb[C_GREEN2];
+    if (!prefetched)
+        rawLoader->start();
+}
 
-            if (camWB[C_GREEN2] <= 0)
-                camWB[C_GREEN2] = camWB[C_GREEN];
+void IIQRemap::cancelRawLoad()
+{
+    if (regionLoader)
+    {
+        regionLoader->disconnect(this);
+        regionLoader->cancel();
+        regionLoader->wait();
+        regionLoader->deleteLater();
+        regionLoader = 0;
+    }
 
-            double maxGreen = std::max(camWB[C_GREEN], camWB[C_GREEN2]);
-            if (maxGreen == 0.0)
-                maxGreen = 1.0;
+    if (rawLoader)
+    {
+        rawLoader->disconnect(this);
+        rawLoader->cancel();
+        rawLoader->wait();
+        rawLoader->deleteLater();
+        rawLoader = 0;
+        ui.rawImage->clearPreview();
+    }
 
-            // normalise camWB
-            camWB[C_RED]    /= maxGreen;
-            camWB[C_GREEN]  /= maxGreen;
-            camWB[C_BLUE]   /= maxGreen;
-            camWB[C_GREEN2] /= maxGreen;
+    if (loadProgress)
+    {
+        loadProgress->disconnect(this);
+        loadProgress->close();
+        loadProgress->deleteLater();
+        loadProgress = 0;
+    }
+}
 
-            // recalculate fit
-            if (ui.cboxZoomLevel->currentIndex()==0)
-                scale = fitScale(iiqFile->imgdata.sizes.raw_width,
-                                 iiqFile->imgdata.sizes.raw_height,
-                                 *ui.rawImage);
-            ui.rawImage->setRawImage(iiqFile, scale);
+void IIQRemap::rawLoadProgress(int step, int steps, const QString& text)
+{
+    if (loadProgress)
+    {
+        loadProgress->setMaximum(steps);
+        loadProgress->setValue(step);
+        loadProgress->setLabelText(text);
+    }
+}
 
-            // update selected Sensor+ buttons
-            lockModeChange = true;
-            if (auto btn = ui.btnGrpSensorPlus->button(ui.rawImage->getSensorPlus()))
-                btn->setChecked(true);
-            lockModeChange = false;
+void IIQRemap::rawLoadPreview(const QImage& image, int width, int height)
+{
+    if (!rawLoader || sender() != rawLoader)
+        return;
 
-            // process raw data to gather stats
-            processRawData();
-            calculateThresholds();
-        }
+    double previewScale = ui.cboxZoomLevel->currentIndex()==0
+                            ? fitScale(width, height, *ui.rawImage)
+                            : scale;
+    ui.rawImage->setPreview(image, width, height, previewScale);
+}
 
-        rawFileName = fileNames.at(0);
-        updateWidgets();
-        updateDefectStats();
-    }
+void IIQRemap::rawLoadRegion(const QImage& image, const QRect& area)
+{
+    if (regionLoader && sender() == regionLoader)
+        ui.rawImage->setRegionPreview(image, area);
+}
 
-    restoreOverrideCursor();
+// Position over the shown raw is where the area of the next raw being
+// loaded is decoded first
+void IIQRemap::rawCursorMoved(uint16_t row, uint16_t col)
+{
+    rawCursor = QPoint(col, row);
+    if (regionLoader)
+        regionLoader->setPosition(row, col);
 }
 
-// The number of files in a stack passed here needs to be limited by MAX_RAWS
-int IIQRemap::loadRawStack(IIQFile& file, QStringList fileNames)
+void IIQRemap::rawLoadFinished()
 {
-    setOverrideCursor(QCursor(Qt::WaitCursor));
+    // loaders cancelled or finished earlier are ignored
+    if (rawLoader && sender() == rawLoader)
+        finishRawLoad();
+}
+
+void IIQRemap::finishRawLoad()
+{
+    RawLoader* loader = rawLoader;
+    rawLoader = 0;
+    loader->disconnect(this);
+    loader->wait();
+    loader->deleteLater();
+    cancelRawLoad();
+
+    int ret = loader->result();
+    if (loader->cancelled() || ret != LIBRAW_SUCCESS)
+        ui.rawImage->clearPreview();
+    if (loader->cancelled())
+        return;
+    else if (ret != LIBRAW_SUCCESS)
+        showMessage(tr("Error"), loader->errorText());
 
-    int rawCount = fileNames.size()>MAX_RAWS ? MAX_RAWS : fileNames.size();
-    auto iiqFiles = std::make_unique<IIQFile[]>(rawCount-1);
-    int result = LIBRAW_SUCCESS;
+    setRawFrame(loader->frame(), ret);
+}
 
-    // attempt to go and open all raw files
-    bool sensorPlus = file.isSensorPlus();
-    for (int i=1; result==LIBRAW_SUCCESS && i<rawCount; ++i)
+// Shows loaded raw, stats are taken from the frame if it is corrected
+// with current calibration
+void IIQRemap::setRawFrame(TRawFrame& frame, int ret)
+{
+    const auto& fileNames = frame.fileNames;
+    auto& iiqFile = frame.iiqFile;
+
+    const auto& calFile = ui.rawImage->getCalFile();
+    if (ret == LIBRAW_SUCCESS && ui.rawImage->hasUnsavedChanges() &&
+        iiqFile->getPhaseOneSerial() != calFile.getCalSerial())
     {
-        if ((result = iiqFiles[i-1].open_file(TO_STDSTR(fileNames.at(i)).c_str())) != LIBRAW_SUCCESS)
-            showMessage(tr("Error"), tr("Error opening file\n%1!").arg(fileNames.at(i)));
-        else if (!iiqFiles[i-1].isPhaseOne())
-        {
-            result = LIBRAW_FILE_UNSUPPORTED;
-            showMessage(tr("Error"),
-                        tr("File %1\ndoes not seem to be Phase One IIQ file!")
-                            .arg(fileNames.at(i)));
-        }
-        else if (file.getPhaseOneSerial() != iiqFiles[i-1].getPhaseOneSerial())
+        if (showMessage(tr("Warning"),
+                        tr("IIQ file %1\ndoes not match current calibration with unsaved changed!").arg(fileNames.at(0)),
+                        tr("Do you want to load IIQ file anyway?"),
+                        QMessageBox::Question,
+                        QMessageBox::Yes | QMessageBox::No,
+                        QMessageBox::Yes) == QMessageBox::No)
         {
-            result = LIBRAW_FILE_UNSUPPORTED;
-            showMessage(tr("Error"),
-                        tr("File %1 is not\nfrom the same Phase One camera as the first file!")
-                            .arg(fileNames.at(i)));
+            ret = LIBRAW_UNSPECIFIED_ERROR;
+            ui.rawImage->clearPreview();
         }
-        else if (iiqFiles[i-1].isSensorPlus() != sensorPlus)
+        else
         {
-            result = LIBRAW_FILE_UNSUPPORTED;
-            auto msg = sensorPlus ? tr("File %1 is not\ntaken with Sensor+ as the first file!")
-                                  : tr("File %1 is taken\nwith Sensor+ unlike the first file!");
-            showMessage(tr("Error"), msg.arg(fileNames.at(i)));
+            // reset mode
+            lockModeChange = true;
+            ui.btnPointMode->setChecked(false);
+            ui.btnColMode->setChecked(false);
+            lockModeChange = false;
         }
-        else if ((result = iiqFiles[i-1].unpack()) != LIBRAW_SUCCESS)
-            showMessage(tr("Error"), tr("Error unpacking IIQ file %1!").arg(fileNames.at(i)));
     }
 
-    // loaded all the raws - calculate the median into first array
-    if (result == LIBRAW_SUCCESS)
+    // actually load the data into control
+    if (ret == LIBRAW_SUCCESS)
     {
-        uint16_t* data = file.imgdata.rawdata.raw_image;
+        setOverrideCursor(QCursor(Qt::WaitCursor));
 
-        tbb::parallel_for(size_t(0), size_t(file.imgdata.sizes.raw_height),
-        [&](size_t row)
-        {
-            int i = row*file.imgdata.sizes.raw_width;
-            for (uint16_t col=0; col<file.imgdata.sizes.raw_width; ++col, ++i)
-            {
-                uint16_t stack[MAX_RAWS];
-                stack[0] = data[i];
-                for (int cnt=1; cnt<rawCount; cnt++)
-                    stack[cnt] = iiqFiles[cnt-1].imgdata.rawdata.raw_image[i];
-                data[i] = calc_median(stack, rawCount);
-            }
-        });
+        // get WB
+        float* wb = iiqFile->imgdata.color.cam_mul;
+
+        if (wb[0] <= 0)
+            wb = iiqFile->imgdata.color.pre_mul;
+
+        camWB[C_RED]    = wb[C_RED];
+        camWB[C_GREEN]  = wb[C_GREEN];
+        camWB[C_BLUE]   = wb[C_BLUE];
+        camWB[C_GREEN2] = wb[C_GREEN2];
+
+        if (camWB[C_GREEN2] <= 0)
+            camWB[C_GREEN2] = camWB[C_GREEN];
+
+        double maxGreen = std::max(camWB[C_GREEN], camWB[C_GREEN2]);
+        if (maxGreen == 0.0)
+            maxGreen = 1.0;
+
+        // normalise camWB
+        camWB[C_RED]    /= maxGreen;
+        camWB[C_GREEN]  /= maxGreen;
+        camWB[C_BLUE]   /= maxGreen;
+        camWB[C_GREEN2] /= maxGreen;
+
+        // recalculate fit
+        if (ui.cboxZoomLevel->currentIndex()==0)
+            scale = fitScale(iiqFile->imgdata.sizes.raw_width,
+                             iiqFile->imgdata.sizes.raw_height,
+                             *ui.rawImage);
+
+        // raw shown in the same sensor mode goes back to the cache
+        bool sensorPlus = iiqFile->isSensorPlus();
+        auto shownFrame = std::make_unique<TRawFrame>();
+        shownFrame->fileNames = rawFiles[sensorPlus];
+        shownFrame->modified = rawModified[sensorPlus];
+        shownFrame->corrHash = ui.rawImage->getCorrHash(sensorPlus);
+        shownFrame->stats = rawStats[sensorPlus];
+
+        // raw is corrected by the loader unless calibration has changed since
+        bool corrected = ui.rawImage->setRawImage(iiqFile, scale, frame.corrHash);
+
+        shownFrame->iiqFile = std::move(iiqFile);
+        if (shownFrame->fileNames != fileNames)
+            rawPrefetcher->cache().put(std::move(shownFrame));
+        rawFiles[sensorPlus] = fileNames;
+        rawModified[sensorPlus] = frame.modified;
+
+        // update selected Sensor+ buttons
+        lockModeChange = true;
+        if (auto btn = ui.btnGrpSensorPlus->button(ui.rawImage->getSensorPlus()))
+            btn->setChecked(true);
+        lockModeChange = false;
+
+        // raw stats are gathered by the loader as well
+        if (corrected)
+            setRawStats(frame.stats);
+        else
+            processRawData();
+        calculateThresholds();
     }
 
-    restoreOverrideCursor();
+    rawFileName = fileNames.at(0);
+    updateWidgets();
+    updateDefectStats();
+
+    thumbBrowser->setCurrentFile(rawFileName);
+    if (ret == LIBRAW_SUCCESS)
+        prefetchRaws();
 
-    return result;
+    restoreOverrideCursor();
 }
 
 // walks through raw data and gets the stats
 void IIQRemap::processRawData()
 {
-    uint16_t rawWidth = ui.rawImage->getRawWidth();
-    uint16_t rawHeight = ui.rawImage->getRawHeight();
-    int nValues = (rawWidth * rawHeight)>>2;
-
-    maxVal[C_RED] = maxVal[C_GREEN] = maxVal[C_BLUE] = maxVal[C_GREEN2] = 0;
-    minVal[C_RED] = minVal[C_GREEN] = minVal[C_BLUE] = minVal[C_GREEN2] = 0xFFFF;
-    avgVal[C_RED] = avgVal[C_GREEN] = avgVal[C_BLUE] = avgVal[C_GREEN2] = 0;
-    stdDev[C_RED] = stdDev[C_GREEN] = stdDev[C_BLUE] = stdDev[C_GREEN2] = 0;
-
-    // calculate mean and stddev
-    for (int row=0; row<rawHeight; ++row)
-        for (int col=0; col<rawWidth; ++col)
-        {
-            EChannel channel = ui.rawImage->getRawColor(row,col);
-            uint16_t val = ui.rawImage->getRawValue(row,col);
-            if (maxVal[channel]<val)
-                maxVal[channel] = val;
-            if (minVal[channel]>val)
-                minVal[channel] = val;
-            avgVal[channel] += val;
-            stdDev[channel] += double(val)*val;
-        }
-
-    stdDev[C_RED]    = sqrt((stdDev[C_RED]-(avgVal[C_RED]*avgVal[C_RED]/nValues))/(nValues-1));
-    stdDev[C_GREEN]  = sqrt((stdDev[C_GREEN]-(avgVal[C_GREEN]*avgVal[C_GREEN]/nValues))/(nValues-1));
-    stdDev[C_BLUE]   = sqrt((stdDev[C_BLUE]-(avgVal[C_BLUE]*avgVal[C_BLUE]/nValues))/(nValues-1));
-    stdDev[C_GREEN2] = sqrt((stdDev[C_GREEN2]-(avgVal[C_GREEN2]*avgVal[C_GREEN2]/nValues))/(nValues-1));
+    TRawStats stats;
+    if (auto& iiqFile = ui.rawImage->getRawImage())
+        calcRawStats(*iiqFile, stats);
+    setRawStats(stats);
+}
 
-    avgVal[C_RED]    /= nValues;
-    avgVal[C_GREEN]  /= nValues;
-    avgVal[C_BLUE]   /= nValues;
-    avgVal[C_GREEN2] /= nValues;
+void IIQRemap::setRawStats(const TRawStats& stats)
+{
+    for (int ch=C_RED; ch<C_ALL; ++ch)
+    {
+        maxVal[ch] = stats.maxVal[ch];
+        minVal[ch] = stats.minVal[ch];
+        avgVal[ch] = stats.avgVal[ch];
+        stdDev[ch] = stats.stdDev[ch];
+    }
+    rawStats[ui.rawImage->getSensorPlus()] = stats;
 
     updateRawStats();
 }
@@ -1059,14 +1241,17 @@ void IIQRemap::updateThresholdStats(EChannel channel)
     else if (channel == C_ALL)
     {
         thrStats[C_RED]=thrStats[C_GREEN]=thrStats[C_BLUE]=thrStats[C_GREEN2]=0;
-        for (int row=0; row<rawHeight; ++row)
-            for (int col=0; col<rawWidth; ++col)
-            {
-                EChannel channel = ui.rawImage->getRawColor(row,col);
-                if (threshold[channel]>0 &&
-                    fabs(avgVal[channel]-ui.rawImage->getRawValue(row,col))>threshold[channel])
-                    thrStats[channel]++;
-            }
+        dispatchCFA(ui.rawImage->getCfaPattern(), [&](auto cfa)
+        {
+            for (int row=0; row<rawHeight; ++row)
+                for (int col=0; col<rawWidth; ++col)
+                {
+                    EChannel channel = EChannel(cfa.color(row,col));
+                    if (threshold[channel]>0 &&
+                        fabs(avgVal[channel]-ui.rawImage->getRawValue(row,col))>threshold[channel])
+                        thrStats[channel]++;
+                }
+        });
     }
     else
     {
@@ -1148,6 +1333,11 @@ void IIQRemap::deleteShownDefects()
     }
 }
 
+void IIQRemap::showCorrStats(bool show)
+{
+    ui.rawImage->showCorrStats(show);
+}
+
 void IIQRemap::help()
 {
     QDir dir(QApplication::applicationDirPath());
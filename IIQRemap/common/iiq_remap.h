@@ -23,9 +23,12 @@
 #define IIQ_REMAP_H
 
 #include "raw_image.h"
+#include "raw_loader.h"
+#include "thumb_browser.h"
 
 #include <QMainWindow>
 #include <QMessageBox>
+#include <QProgressDialog>
 #include <QLabel>
 #include <QPoint>
 #include <QSettings>
@@ -182,6 +185,9 @@ class IIQRemap : public QMainWindow
     double stdDev[4];
     double avgVal[4];
 
+    // stats of the raw shown for either sensor mode
+    TRawStats rawStats[2];
+
     uint16_t threshold[4];
     uint32_t thrStats[4];
 
@@ -199,6 +205,25 @@ class IIQRemap : public QMainWindow
     bool lockThresChange;
     bool overrideCursorSet;
 
+    // raw being loaded in background with the area under the cursor
+    // decoded ahead of it
+    RawLoader* rawLoader;
+    RegionLoader* regionLoader;
+    QPoint rawCursor;
+    QProgressDialog* loadProgress;
+
+    // neighbouring raws in the folder decoded ahead
+    RawPrefetcher* rawPrefetcher;
+    int rawStep;
+
+    // files shown for either sensor mode and their modification time,
+    // those go back to the cache when replaced
+    QStringList rawFiles[2];
+    qint64 rawModified[2];
+
+    // folder browser with thumbnails
+    ThumbnailBrowser* thumbBrowser;
+
 public:
 	IIQRemap();
 	~IIQRemap();
@@ -234,13 +259,18 @@ private:
     }
 
     void processRawData();
+    void setRawStats(const TRawStats& stats);
+    void startRawLoad(const QStringList& fileNames);
+    void finishRawLoad();
+    void setRawFrame(TRawFrame& frame, int ret);
+    void stepRaw(int step);
+    void prefetchRaws();
     void resizeEvent(QResizeEvent *event);
     void updateRawStats();
     void updateDefectStats();
     void updateThresholdStats(EChannel channel);
     void updateAutoRemap();
     void updateWidgets();
-    int  loadRawStack(IIQFile& file, QStringList fileNames);
     bool checkUnsavedAndSave();
     bool accepLicense();
     bool saveCal();
@@ -255,6 +285,15 @@ private Q_SLOTS:
     void applyToFiles();
 
     void loadRaw();
+    void loadRaws(QStringList fileNames);
+    void nextRaw();
+    void prevRaw();
+    void cancelRawLoad();
+    void rawLoadProgress(int step, int steps, const QString& text);
+    void rawLoadPreview(const QImage& image, int width, int height);
+    void rawLoadRegion(const QImage& image, const QRect& area);
+    void rawLoadFinished();
+    void rawCursorMoved(uint16_t row, uint16_t col);
 
     void sensorPlusSelected(int id);
 
@@ -266,6 +305,7 @@ private Q_SLOTS:
 
     void help();
     void about();
+    void showCorrStats(bool show);
 
     void zoomFit();
     void zoomFull();
@@ -24,10 +24,19 @@
 
 #include <QString>
 
+#include <tbb/tbb.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <ctime>
 #include <cstdio>
+#include <cstring>
 #include <filesystem>
 #include <map>
+#include <tuple>
 
 #pragma pack(push)
 #pragma pack(1)
@@ -56,6 +65,19 @@
 #define TAG_EXIF_MAKERNOTE  37500
 #define TAG_STRIPOFFSETS  273
 
+#define TAG_IMAGEWIDTH       256
+#define TAG_IMAGELENGTH      257
+#define TAG_BITSPERSAMPLE    258
+#define TAG_COMPRESSION      259
+#define TAG_PHOTOMETRIC      262
+#define TAG_SAMPLESPERPIXEL  277
+#define TAG_STRIPBYTECOUNTS  279
+#define TAG_PLANARCONFIG     284
+
+// Limits for reading preview strips
+#define THUMB_MAX_IFDS    8
+#define THUMB_MAX_BYTES   (16<<20)
+
 struct TTiffHeader
 {
     uint16_t magic;      // magic number (defines byte order)
@@ -235,6 +257,7 @@ struct IIQFileData
     TIIQHeader* iiqHdr_ = nullptr;
     bool convEndian_ = false;
 
+    bool parseHeader(uint8_t* inBuf, size_t size);
     bool parseFileData(std::vector<uint8_t>& fileData);
     bool adjustFileData(std::vector<uint8_t>& fileData, const uint32_t newCalSize);
 };
@@ -469,13 +492,11 @@ uint64_t convEndian64(uint64_t uValue, bool convert)
 }
 
 // internal struct methods
-bool IIQFileData::parseFileData(std::vector<uint8_t>& fileData)
+bool IIQFileData::parseHeader(uint8_t* inBuf, size_t size)
 {
-    if (sizeof(TTiffHeader)+sizeof(TIIQHeader)>fileData.size())
+    if (sizeof(TTiffHeader)+sizeof(TIIQHeader)>size)
         return false;
 
-    auto inBuf = fileData.data();
-
     tiffHdr_ = (TTiffHeader*)inBuf;
     iiqHdr_ = (TIIQHeader*)(inBuf+sizeof(TTiffHeader));
     bool valid = (tiffHdr_->magic == TIFF_LITTLEENDIAN ||
@@ -488,9 +509,17 @@ bool IIQFileData::parseFileData(std::vector<uint8_t>& fileData)
         valid = convEndian32(iiqHdr_->rawMagic, convEndian_)>>8 == IIQ_RAW &&
                 convEndian32(iiqHdr_->dirOffset, convEndian_) != 0xbad0bad;
     }
-    if (!valid)
+
+    return valid;
+}
+
+bool IIQFileData::parseFileData(std::vector<uint8_t>& fileData)
+{
+    if (!parseHeader(fileData.data(), fileData.size()))
         return false;
 
+    auto inBuf = fileData.data();
+
     // parse tiff IFDs
     uint32_t ifdOffset = convEndian32(tiffHdr_->dirOffset, convEndian_);
     uint32_t entries = convEndian16(*(uint16_t*)(inBuf+ifdOffset), convEndian_);
@@ -649,6 +678,132 @@ bool IIQFileData::adjustFileData(std::vector<uint8_t>& fileData, const uint32_t
     return true;
 }
 
+// TIFF tag value - short values are at the start of the data field
+static uint32_t tiffTagValue(const TTiffTagEntry& tagData, bool convEndian)
+{
+    if (convEndian16(tagData.dataType, convEndian) == TIFF_SHORT)
+        return convEndian16(*(const uint16_t*)&tagData.dataOffset, convEndian);
+
+    return convEndian32(tagData.dataOffset, convEndian);
+}
+
+// Reads only the standard TIFF part of IIQ file - the header, IFDs and
+// the strips of the largest uncompressed RGB preview
+bool readIIQThumbnail(const IIQCalFile::TFileNameType& fileName, TIIQThumbnail& thumbnail)
+{
+#if defined(WIN32) || defined(_WIN32)
+    std::unique_ptr<FILE, int(*)(FILE*)> file(_wfopen(fileName.c_str(), L"rb"), std::fclose);
+#else
+    std::unique_ptr<FILE, int(*)(FILE*)> file(std::fopen(fileName.c_str(), "rb"), std::fclose);
+#endif
+    if (!file)
+        return false;
+
+    auto readAt = [&file](uint32_t offset, void* buf, size_t size)
+    {
+        return std::fseek(file.get(), offset, SEEK_SET) == 0 &&
+               std::fread(buf, 1, size, file.get()) == size;
+    };
+
+    uint8_t header[sizeof(TTiffHeader)+sizeof(TIIQHeader)];
+    IIQFileData iiqData;
+    if (!readAt(0, header, sizeof(header)) || !iiqData.parseHeader(header, sizeof(header)))
+        return false;
+
+    bool convEndian = iiqData.convEndian_;
+
+    // values of array tag with short or long elements
+    auto readArray = [&](const TTiffTagEntry& tagData, std::vector<uint32_t>& values)
+    {
+        uint32_t dataType = convEndian16(tagData.dataType, convEndian);
+        uint32_t count = convEndian32(tagData.dataCount, convEndian);
+        uint32_t elemSize = getTagDataSize(dataType);
+        if ((dataType != TIFF_SHORT && dataType != TIFF_LONG) || count == 0 || count > 0x10000)
+            return false;
+
+        std::vector<uint8_t> data(count*elemSize);
+        if (data.size() <= 4)
+            memcpy(data.data(), &tagData.dataOffset, data.size());
+        else if (!readAt(convEndian32(tagData.dataOffset, convEndian), data.data(), data.size()))
+            return false;
+
+        values.resize(count);
+        for (uint32_t i=0; i<count; ++i)
+            values[i] = elemSize == 2 ? convEndian16(((uint16_t*)data.data())[i], convEndian)
+                                      : convEndian32(((uint32_t*)data.data())[i], convEndian);
+        return true;
+    };
+
+    std::vector<uint32_t> bestOffsets;
+    std::vector<uint32_t> bestCounts;
+    uint32_t bestWidth = 0;
+    uint32_t bestHeight = 0;
+
+    uint32_t ifdOffset = convEndian32(iiqData.tiffHdr_->dirOffset, convEndian);
+    for (int ifd=0; ifd<THUMB_MAX_IFDS && ifdOffset; ++ifd)
+    {
+        uint16_t entries = 0;
+        if (!readAt(ifdOffset, &entries, sizeof(entries)))
+            break;
+        entries = convEndian16(entries, convEndian);
+
+        std::vector<TTiffTagEntry> tags(entries);
+        uint32_t nextIfd = 0;
+        if (!readAt(ifdOffset+2, tags.data(), entries*sizeof(TTiffTagEntry)) ||
+            !readAt(ifdOffset+2+entries*sizeof(TTiffTagEntry), &nextIfd, sizeof(nextIfd)))
+            break;
+
+        uint32_t width = 0, height = 0, compression = 1, photometric = 0;
+        uint32_t samples = 1, planar = 1;
+        std::vector<uint32_t> bits, offsets, counts;
+        for (const auto& tagData: tags)
+            switch (convEndian16(tagData.tiffTag, convEndian))
+            {
+                case TAG_IMAGEWIDTH:      width = tiffTagValue(tagData, convEndian); break;
+                case TAG_IMAGELENGTH:     height = tiffTagValue(tagData, convEndian); break;
+                case TAG_COMPRESSION:     compression = tiffTagValue(tagData, convEndian); break;
+                case TAG_PHOTOMETRIC:     photometric = tiffTagValue(tagData, convEndian); break;
+                case TAG_SAMPLESPERPIXEL: samples = tiffTagValue(tagData, convEndian); break;
+                case TAG_PLANARCONFIG:    planar = tiffTagValue(tagData, convEndian); break;
+                case TAG_BITSPERSAMPLE:   readArray(tagData, bits); break;
+                case TAG_STRIPOFFSETS:    readArray(tagData, offsets); break;
+                case TAG_STRIPBYTECOUNTS: readArray(tagData, counts); break;
+            }
+
+        // only 8 bit uncompressed RGB is used
+        bool rgb8 = compression == 1 && photometric == 2 && samples == 3 && planar == 1 &&
+                    !bits.empty() && std::all_of(bits.begin(), bits.end(), [](uint32_t b) { return b == 8; });
+        if (rgb8 && size_t(width)*height > size_t(bestWidth)*bestHeight && size_t(width)*height*3 <= THUMB_MAX_BYTES &&
+            !offsets.empty() && offsets.size() == counts.size())
+        {
+            bestWidth = width;
+            bestHeight = height;
+            bestOffsets.swap(offsets);
+            bestCounts.swap(counts);
+        }
+
+        ifdOffset = convEndian32(nextIfd, convEndian);
+    }
+
+    if (bestWidth == 0 || bestHeight == 0)
+        return false;
+
+    thumbnail.width = bestWidth;
+    thumbnail.height = bestHeight;
+    thumbnail.rgb.assign(size_t(bestWidth)*bestHeight*3, 0);
+
+    size_t pos = 0;
+    for (size_t i=0; i<bestOffsets.size() && pos<thumbnail.rgb.size(); ++i)
+    {
+        size_t size = std::min<size_t>(bestCounts[i], thumbnail.rgb.size()-pos);
+        if (!readAt(bestOffsets[i], thumbnail.rgb.data()+pos, size))
+            return false;
+        pos += size;
+    }
+
+    return pos == thumbnail.rgb.size();
+}
+
 // constructors and assignements
 IIQCalFile::IIQCalFile(const std::vector<uint8_t>& data)
     : hasChanges_{false,false}, convEndian_(false), hasSensorPlus_(false)
@@ -808,6 +963,37 @@ bool IIQCalFile::removeDefCol(int col, bool sensorPlus)
     return deleted;
 }
 
+// FNV-1a hash over the calibration data and defects if applied
+uint64_t IIQCalFile::corrHash(bool sensorPlus, bool withDefects) const
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto addBytes = [&hash](const void* data, size_t size)
+    {
+        auto bytes = static_cast<const uint8_t*>(data);
+        for (size_t i=0; i<size; ++i)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    };
+
+    addBytes(calSerial_.data(), calSerial_.size());
+    addBytes(calFileData_[sensorPlus].data(), calFileData_[sensorPlus].size());
+    addBytes(&withDefects, sizeof(withDefects));
+
+    if (withDefects)
+    {
+        size_t counts[2] = { defPixels_[sensorPlus].size(), defCols_[sensorPlus].size() };
+        addBytes(counts, sizeof(counts));
+        for (auto [col, row] : defPixels_[sensorPlus])
+        {
+            addBytes(&col, sizeof(col));
+            addBytes(&row, sizeof(row));
+        }
+        for (auto col : defCols_[sensorPlus])
+            addBytes(&col, sizeof(col));
+    }
+
+    return hash;
+}
+
 // saving cal file
 bool IIQCalFile::saveCalFile()
 {
@@ -1241,13 +1427,73 @@ bool IIQCalFile::saveToIIQ(std::vector<uint8_t>& iiqFileData)
 #define order        libraw_internal_data.unpacker_data.order
 #define ifp          libraw_internal_data.internal_data.input
 #define ph1          imgdata.color.phase_one_data
+#define data_offset  libraw_internal_data.unpacker_data.data_offset
+#define strip_offset libraw_internal_data.unpacker_data.strip_offset
+
+using TCorrClock = std::chrono::steady_clock;
+
+inline int64_t nsSince(TCorrClock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(TCorrClock::now() - start).count();
+}
+
+// TCorrStats functions
+const char* TCorrStats::stageName(EStage stage)
+{
+    static const char* names[CS_COUNT] = {
+        "Black", "Parse", "Curve", "Quad LUT", "Quad mult",
+        "Flat field", "Defects", "Total" };
+
+    return stage < CS_COUNT ? names[stage] : "";
+}
+
+std::string TCorrStats::toString() const
+{
+    std::string result;
+    char line[128];
+    for (int i = 0; i < CS_COUNT; ++i)
+    {
+        if (i != CS_TOTAL && time[i] == 0 && bytes[i] == 0)
+            continue;
+        std::snprintf(line, sizeof(line), "%-10s %9.2f ms %9.1f MB",
+                      stageName(EStage(i)), time[i], bytes[i]/(1024.0*1024.0));
+        result += line;
+        if (stages[i] > 1)
+        {
+            std::snprintf(line, sizeof(line), "  x%u", stages[i]);
+            result += line;
+        }
+        if (i == CS_DEFECTS)
+        {
+            std::snprintf(line, sizeof(line), "  %u pixels, %u cols", defPixels, defCols);
+            result += line;
+        }
+        result += '\n';
+    }
+    return result;
+}
 
 // IIQFile functions
+bool IIQFile::defaultFixedFlatField_ = false;
+
+IIQFile::IIQFile(): LibRaw(), tiledCorr_(true),
+                              corrCacheSize_(0),
+                              fixedFlatField_(defaultFixedFlatField_),
+                              keepPreDefect_(false),
+                              preDefectKept_(false)
+{
+}
+
 IIQFile::~IIQFile()
 {
-    if (is_phaseone_compressed() &&
-        imgdata.rawdata.raw_image &&
-        imgdata.rawdata.raw_alloc != imgdata.rawdata.raw_image)
+    endRegionDecode();
+
+    // corrected raw buffer is owned here - LibRaw must only see its own
+    if (!corrRaw_.empty() && imgdata.rawdata.raw_image == corrRaw_.data())
+        imgdata.rawdata.raw_image = (ushort *)imgdata.rawdata.raw_alloc;
+    else if (is_phaseone_compressed() &&
+             imgdata.rawdata.raw_image &&
+             imgdata.rawdata.raw_alloc != imgdata.rawdata.raw_image)
         phase_one_free_tempbuffer();
 }
 
@@ -1262,11 +1508,11 @@ bool IIQFile::isSensorPlus()
     readCalData();
     if (calFileData_.size() > sizeof(TSensorPlusFooter))
     {
-        convEndian_ = *(uint32_t*)calFileData_.data() == IIQ_BIGENDIAN;
+        bool convEndian = *(uint32_t*)calFileData_.data() == IIQ_BIGENDIAN;
         auto footer = (TSensorPlusFooter*)(calFileData_.data() + calFileData_.size()
                                            - sizeof(TSensorPlusFooter));
-        if (convEndian32(footer->calFooterMagic, convEndian_) == CAL_FOOTER_MAGIC)
-            return convEndian32(footer->calNumber, convEndian_) == 2;
+        if (convEndian32(footer->calFooterMagic, convEndian) == CAL_FOOTER_MAGIC)
+            return convEndian32(footer->calNumber, convEndian) == 2;
     }
     return false;
 }
@@ -1289,45 +1535,266 @@ void IIQFile::closeFileStream()
     recycle_datastream(); // close file handle
 }
 
-// Applies corrections
-void IIQFile::applyPhaseOneCorr(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects)
+size_t IIQFile::memoryUsed() const
 {
-    if (!is_phaseone_compressed() || !imgdata.rawdata.raw_alloc)
-        return;
+    size_t rawSize = imgdata.rawdata.raw_alloc
+                        ? size_t(imgdata.sizes.raw_width)*imgdata.sizes.raw_height*sizeof(uint16_t)
+                        : 0;
 
-    try
-    {
-        if (imgdata.rawdata.raw_image &&
-            imgdata.rawdata.raw_alloc != imgdata.rawdata.raw_image)
-            phase_one_free_tempbuffer();
+    // kept pre-defect pixels are counted with tree node overhead
+    size_t preDefectSize = preDefectPixels_.size()*(sizeof(std::pair<uint32_t,uint16_t>) + 4*sizeof(void*)) +
+                           preDefectCols_.size()*imgdata.sizes.raw_height*sizeof(uint16_t);
 
-        phase_one_allocate_tempbuffer();
-        int rc = phase_one_subtract_black((ushort *)imgdata.rawdata.raw_alloc,
-                                          imgdata.rawdata.raw_image);
-        if (rc == 0)
+    return rawSize + calFileData_.capacity() + corrRaw_.capacity()*sizeof(uint16_t) + preDefectSize;
+}
+
+// Compressed data is read and decoded in bands of rows, a few bands for
+// each thread are in flight at once
+#define DECODE_BAND_ROWS        32
+#define DECODE_BANDS_IN_FLIGHT  2
+
+// Most bytes a compressed row can take - 16 bits for each pixel and up
+// to 12 bits of code lengths every 8 pixels read in 4 byte words
+inline size_t ph1RowBytes(unsigned rawWidth)
+{
+    return size_t(rawWidth)*2 + (rawWidth/8)*2 + 8;
+}
+
+// Bit reader over in memory Phase One compressed data. Same as LibRaw
+// ph1_bits reading data past its end as all bits set.
+class TPh1Bits
+{
+public:
+    TPh1Bits(const std::vector<uint8_t>& data, size_t pos, bool convEndian)
+        : data_(data), pos_(pos), convEndian_(convEndian), bitbuf_(0), vbits_(0) {}
+
+    unsigned get(int n)
+    {
+        if (n == 0)
+            return 0;
+        if (vbits_ < n)
         {
-            std::vector<uint8_t> data;
-            if (applyDefects && calFile.hasUnsavedChanges())
-                calFile.saveToData(data, sensorPlus);
-
-            const auto& calData = applyDefects && calFile.hasUnsavedChanges()
-                                    ? data : calFile.getCalFileData(sensorPlus);
-            calData_ = calData.data();
-            calDataEnd_ = calData_ + calData.size();
-            calDataCurPtr_ = calData_;
-
-            rc = phase_one_correct(applyDefects);
-            calData_ = calDataEnd_ = calDataCurPtr_ = nullptr;
+            bitbuf_ = bitbuf_ << 32 | get4();
+            vbits_ += 32;
         }
+        unsigned c = unsigned(bitbuf_ << (64 - vbits_) >> (64 - n));
+        vbits_ -= n;
+        return c;
     }
-    catch (const std::bad_alloc&)
+
+private:
+    uint32_t get4()
     {
-        recycle();
+        uint32_t val = 0xffffffff;
+        if (pos_ < data_.size())
+            std::memcpy(&val, data_.data() + pos_, std::min(size_t(4), data_.size() - pos_));
+        pos_ += 4;
+        return convEndian32(val, convEndian_);
     }
-    catch (const LibRaw_exceptions& err)
+
+    const std::vector<uint8_t>& data_;
+    size_t pos_;
+    bool convEndian_;
+    uint64_t bitbuf_;
+    int vbits_;
+};
+
+int IIQFile::unpack()
+{
+    endRegionDecode();
+
+    // native decoder replaces LibRaw one for the duration of unpack
+    auto loadRaw = load_raw;
+    if (load_raw == &IIQFile::phase_one_load_raw_c && ph1.format != 6)
+        load_raw = static_cast<void (LibRaw::*)()>(&IIQFile::phase_one_load_raw_parallel);
+    int ret = LibRaw::unpack();
+    load_raw = loadRaw;
+    return ret;
+}
+
+// Reads row offsets from strip table along with black columns and rows
+// data and sets up the curve - same as LibRaw phase_one_load_raw_c
+void IIQFile::phase_one_read_strips(std::vector<uint32_t>& offset)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+    const bool convEndian = order != 0x4949;
+
+    offset.resize(rawHeight);
+    ifp->seek(strip_offset, SEEK_SET);
+    if (ifp->read(offset.data(), 4, rawHeight) != int(rawHeight))
+        throw LIBRAW_EXCEPTION_IO_EOF;
+    for (auto& off: offset)
+        off = convEndian32(off, convEndian);
+
+    // black columns and rows
+    std::vector<uint16_t> black(2*(rawHeight + rawWidth), 0);
+    if (ph1.black_col)
     {
-        recycle();
+        ifp->seek(ph1.black_col, SEEK_SET);
+        ifp->read(black.data(), 2, 2*rawHeight);
+    }
+    if (ph1.black_row)
+    {
+        ifp->seek(ph1.black_row, SEEK_SET);
+        ifp->read(black.data() + 2*rawHeight, 2, 2*rawWidth);
     }
+    for (auto& blk: black)
+        blk = convEndian16(blk, convEndian);
+    if (ph1.black_col || ph1.black_row)
+    {
+        imgdata.rawdata.ph1_cblack = (short(*)[2])calloc(rawHeight*2, sizeof(ushort));
+        std::memcpy(imgdata.rawdata.ph1_cblack, black.data(), rawHeight*2*sizeof(ushort));
+        imgdata.rawdata.ph1_rblack = (short(*)[2])calloc(rawWidth*2, sizeof(ushort));
+        std::memcpy(imgdata.rawdata.ph1_rblack, black.data() + 2*rawHeight, rawWidth*2*sizeof(ushort));
+    }
+
+    for (int i = 0; i < 256; i++)
+        imgdata.color.curve[i] = i * i / 3.969 + 0.5;
+}
+
+// Decodes columns up to colEnd of one row starting with code lengths in
+// len. Returns true if the row did not set the lengths at its start and
+// so depends on ones left by the previous row.
+static bool decodePh1Row(TPh1Bits& bits, ushort* dest, unsigned rawWidth, unsigned colEnd,
+                         int format, const ushort* curve, int len[2], bool& dataError)
+{
+    static const int length[] = { 8, 7, 6, 9, 11, 10, 5, 12, 14, 13 };
+    int pred[2] = { 0, 0 };
+    bool inherits = false;
+    for (unsigned col = 0; col < colEnd; col++)
+    {
+        int i, j;
+        if (col >= (rawWidth & -8))
+            len[0] = len[1] = 14;
+        else if ((col & 7) == 0)
+            for (i = 0; i < 2; i++)
+            {
+                for (j = 0; j < 5 && !bits.get(1); j++)
+                    ;
+                if (j--)
+                    len[i] = length[j * 2 + bits.get(1)];
+                else if (col == 0)
+                    inherits = true;
+            }
+        ushort pixel;
+        if ((i = len[col & 1]) == 14)
+            pixel = pred[col & 1] = bits.get(16);
+        else if (i > 0)
+            pixel = pred[col & 1] += bits.get(i) + 1 - (1 << (i - 1));
+        else
+            pixel = pred[col & 1];
+        if (pred[col & 1] >> 16)
+            dataError = true;
+        if (format == 5 && pixel < 256)
+            pixel = curve[pixel];
+        dest[col] = format == 8 ? pixel : ushort(pixel << 2);
+    }
+    return inherits;
+}
+
+// Reads compressed data of rows in [rowStart, rowEnd) - the span from the
+// first row start to the end the last one can reach. Data starts at
+// dataStart relative to data_offset.
+void IIQFile::phase_one_read_band(const std::vector<uint32_t>& offset,
+                                  unsigned rowStart, unsigned rowEnd,
+                                  std::vector<uint8_t>& data, size_t& dataStart)
+{
+    const auto range = std::minmax_element(offset.begin() + rowStart, offset.begin() + rowEnd);
+    const INT64 fileEnd = ifp->size() - data_offset;
+    const INT64 end = std::min(INT64(*range.second) + INT64(ph1RowBytes(imgdata.sizes.raw_width)),
+                               fileEnd);
+    dataStart = *range.first;
+    data.clear();
+    if (end > INT64(dataStart))
+    {
+        data.resize(end - dataStart);
+        ifp->seek(data_offset + dataStart, SEEK_SET);
+        data.resize(std::max(ifp->read(data.data(), 1, data.size()), 0));
+    }
+}
+
+// Same as LibRaw phase_one_load_raw_c but with rows decoded in parallel
+// using row offsets in strip table. Compressed data is read in bands of
+// rows so only the bands being decoded are held in memory.
+void IIQFile::phase_one_load_raw_parallel()
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+    const bool convEndian = order != 0x4949;
+
+    std::vector<uint32_t> offset;
+    phase_one_read_strips(offset);
+
+    struct TBand
+    {
+        unsigned rowStart = 0;
+        unsigned rowEnd = 0;
+        size_t dataStart = 0;
+        std::vector<uint8_t> data;
+    };
+    using TBandPtr = std::shared_ptr<TBand>;
+
+    // Code lengths are set at the start of each row in valid data. When
+    // they are not, the row continues with lengths left by the previous
+    // one so it is decoded again once that row is done, along with its
+    // error flag.
+    std::vector<std::array<int,2>> rowLen(rawHeight, {{ 0, 0 }});
+    std::vector<uint8_t> rowInherits(rawHeight, 0);
+    std::vector<uint8_t> rowError(rawHeight, 0);
+
+    auto decodeRow = [&](const TBand& band, unsigned row)
+    {
+        TPh1Bits bits(band.data, offset[row] - band.dataStart, convEndian);
+        bool error = false;
+        rowInherits[row] = decodePh1Row(bits, imgdata.rawdata.raw_image + size_t(row)*rawWidth,
+                                        rawWidth, rawWidth, ph1.format, imgdata.color.curve,
+                                        rowLen[row].data(), error);
+        rowError[row] = error;
+    };
+
+    // bands are read in order, decoded in parallel and rows continuing
+    // previous ones are decoded again in order
+    unsigned nextRow = 0;
+    const size_t inFlight = DECODE_BANDS_IN_FLIGHT*std::max(tbb::this_task_arena::max_concurrency(), 1);
+    tbb::parallel_pipeline(inFlight,
+        tbb::make_filter<void, TBandPtr>(tbb::filter_mode::serial_in_order,
+        [&](tbb::flow_control& fc) -> TBandPtr
+        {
+            checkCancel();
+            if (nextRow >= rawHeight)
+            {
+                fc.stop();
+                return nullptr;
+            }
+            auto band = std::make_shared<TBand>();
+            band->rowStart = nextRow;
+            band->rowEnd = nextRow = std::min(nextRow + DECODE_BAND_ROWS, rawHeight);
+            phase_one_read_band(offset, band->rowStart, band->rowEnd, band->data, band->dataStart);
+            return band;
+        }) &
+        tbb::make_filter<TBandPtr, TBandPtr>(tbb::filter_mode::parallel,
+        [&](TBandPtr band) -> TBandPtr
+        {
+            for (unsigned row = band->rowStart; row < band->rowEnd; ++row)
+                decodeRow(*band, row);
+            return band;
+        }) &
+        tbb::make_filter<TBandPtr, void>(tbb::filter_mode::serial_in_order,
+        [&](TBandPtr band)
+        {
+            for (unsigned row = std::max(band->rowStart, 1u); row < band->rowEnd; ++row)
+                if (rowInherits[row])
+                {
+                    rowLen[row] = rowLen[row-1];
+                    decodeRow(*band, row);
+                }
+        }));
+
+    if (std::find(rowError.begin(), rowError.end(), 1) != rowError.end())
+        derror();
+
+    imgdata.color.maximum = 0xfffc - ph1.t_black;
 }
 
 inline uint32_t abs32(int32_t x)
@@ -1353,59 +1820,145 @@ inline T constrain(T x, T l, T u)
     return x < l ? l : (x > u ? u : x);
 }
 
-void IIQFile::dataSetPos(uint32_t pos, bool fromCur)
+// Starting state of the flat field grid row interpolation for one band
+// of rows between two grid rows
+struct TFlatFieldBand
+{
+    unsigned rowStart = 0;
+    unsigned rowEnd = 0;
+    std::vector<float> mrow;
+};
+
+// Correction stage parsed from calibration data - stages only modify
+// pixels in place row by row so can be applied to any range of rows
+struct TCorrStage
+{
+    enum EStageType
+    {
+        ST_CURVE,          // curve applied from startCol
+        ST_QUAD_CURVES,    // curve per quadrant
+        ST_QUAD_MULT,      // multiplier per quadrant
+        ST_FLAT_FIELD      // interpolated flat field
+    };
+
+    EStageType type = ST_CURVE;
+    unsigned startCol = 0;
+
+    // one or four (per quadrant) curves
+    std::vector<uint16_t> curves;
+
+    // quadrant multipliers
+    float qmult[2][2] = {{1, 1}, {1, 1}};
+
+    // flat field data
+    ushort head[8] = { 0 };
+    unsigned nc = 0;
+    unsigned wide = 0;
+    std::vector<TFlatFieldBand> ffBands;
+};
+
+// Bad pixel repair compiled from the defect list - offset of the pixel
+// and offsets of up to 8 same colour neighbours to average
+struct TDefectGather
+{
+    uint32_t target;
+    uint32_t count;
+    uint32_t sources[8];
+};
+
+// All corrections for the raw in the order they need applying
+struct TCorrPlan
+{
+    std::vector<TCorrStage> stages;
+    std::vector<unsigned> badCols;
+
+    // pixels not reading or read by other bad pixels sorted by offset
+    // go first followed by the rest in calibration order
+    std::vector<TDefectGather> defectGather;
+    size_t isolatedDefects = 0;
+
+    // whether calibration order of the rest is by column then row as
+    // calibration with edited defects saves them
+    bool dependentSorted = true;
+};
+
+// Per correction run state - calibration data cursor and the parsed
+// corrections. Keeping it out of IIQFile and LibRaw shared data makes
+// corrections of different IIQFile objects safe to run concurrently.
+struct TCorrContext
+{
+    const uint8_t* calData;
+    const uint8_t* calDataEnd;
+    const uint8_t* calDataCurPtr;
+    bool convEndian = false;
+
+    TCorrPlan plan;
+    double parseTime = 0;
+
+    TCorrContext(const std::vector<uint8_t>& data)
+        : calData(data.data()), calDataEnd(data.data()+data.size()), calDataCurPtr(data.data()) {}
+
+    uint32_t dataGetPos() const { return calDataCurPtr-calData; }
+    void dataSetPos(uint32_t pos, bool fromCur = false);
+    void getShorts(uint16_t *shorts, uint32_t count);
+    uint16_t get16();
+    uint32_t get32();
+    float getFloat();
+};
+
+void TCorrContext::dataSetPos(uint32_t pos, bool fromCur)
 {
-    auto newDataPtr = (fromCur ? calDataCurPtr_ : calData_) + pos;
-    if (newDataPtr<calDataEnd_)
-        calDataCurPtr_ = newDataPtr;
+    auto newDataPtr = (fromCur ? calDataCurPtr : calData) + pos;
+    if (newDataPtr<calDataEnd)
+        calDataCurPtr = newDataPtr;
     else
-        calDataCurPtr_ = calDataEnd_;
+        calDataCurPtr = calDataEnd;
 }
 
-void IIQFile::getShorts(uint16_t *shorts, uint32_t count)
+void TCorrContext::getShorts(uint16_t *shorts, uint32_t count)
 {
-    if (calDataCurPtr_+(count<<1) > calDataEnd_)
+    if (calDataCurPtr+(count<<1) > calDataEnd)
         throw LIBRAW_EXCEPTION_IO_CORRUPT;
-    if (convEndian_)
-        swab((char*)calDataCurPtr_, (char*)shorts, count<<1);
+    if (convEndian)
+        swab((char*)calDataCurPtr, (char*)shorts, count<<1);
     else
-        std::memcpy(shorts, calDataCurPtr_, count<<1);
-    calDataCurPtr_ += count<<1;
+        std::memcpy(shorts, calDataCurPtr, count<<1);
+    calDataCurPtr += count<<1;
 }
 
-uint16_t IIQFile::get16()
+uint16_t TCorrContext::get16()
 {
-    if (calDataCurPtr_+2 > calDataEnd_)
+    if (calDataCurPtr+2 > calDataEnd)
         throw LIBRAW_EXCEPTION_IO_CORRUPT;
-    uint16_t* data = (uint16_t*)calDataCurPtr_;
-    calDataCurPtr_+=2;
+    uint16_t* data = (uint16_t*)calDataCurPtr;
+    calDataCurPtr+=2;
 
-    return convEndian16(*data, convEndian_);
+    return convEndian16(*data, convEndian);
 }
 
-uint32_t IIQFile::get32()
+uint32_t TCorrContext::get32()
 {
-    if (calDataCurPtr_+4 > calDataEnd_)
+    if (calDataCurPtr+4 > calDataEnd)
         throw LIBRAW_EXCEPTION_IO_CORRUPT;
-    uint32_t* data = (uint32_t*)calDataCurPtr_;
-    calDataCurPtr_+=4;
+    uint32_t* data = (uint32_t*)calDataCurPtr;
+    calDataCurPtr+=4;
 
-    return convEndian32(*data, convEndian_);
+    return convEndian32(*data, convEndian);
 }
 
-float IIQFile::getFloat()
+float TCorrContext::getFloat()
 {
-    if (calDataCurPtr_+4 > calDataEnd_)
+    if (calDataCurPtr+4 > calDataEnd)
         throw LIBRAW_EXCEPTION_IO_CORRUPT;
 
-    uint32_t* data = (uint32_t*)calDataCurPtr_;
-    calDataCurPtr_+=4;
+    uint32_t* data = (uint32_t*)calDataCurPtr;
+    calDataCurPtr+=4;
     union {
         uint32_t i;
         float f;
     } u;
 
-    u.i = convEndian32(*data, convEndian_);
+    u.i = convEndian32(*data, convEndian);
     return u.f;
 }
 
@@ -1421,25 +1974,137 @@ int IIQFile::p1raw(unsigned row, unsigned col) const
             ? RAW(row, col) : 0;
 }
 
+// Closest same colour neighbours for green (first 8) and the other
+// colours (last 8)
+static const int8_t pixelAvgDirs[12][2] = {
+    {-1, -1}, {-1, 1}, {1, -1},  {1, 1},  {-2, 0}, {0, -2},
+    {0, 2},   {2, 0},  {-2, -2}, {-2, 2}, {2, -2}, {2, 2} };
+
+// Compiles bad pixels into gather table with the same results as fixing
+// them one by one in the given order. Pixels that neither read nor are
+// read by other bad pixels can be fixed in any order so go first.
+void IIQFile::phase_one_compile_defects(TCorrPlan& plan,
+                                        const std::vector<std::pair<unsigned,unsigned>>& badPixels)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+
+    std::vector<TDefectGather> gather;
+    std::vector<uint32_t> targets;
+    gather.reserve(badPixels.size());
+    targets.reserve(badPixels.size());
+    for (auto [row, col]: badPixels)
+    {
+        TDefectGather entry = { row*rawWidth + col, 0, { 0 } };
+        int j = (FC(row - imgdata.sizes.top_margin, col - imgdata.sizes.left_margin) != 1) * 4;
+        for (int i = j; i < j + 8; i++)
+        {
+            unsigned srcRow = row + pixelAvgDirs[i][0];
+            unsigned srcCol = col + pixelAvgDirs[i][1];
+            if (srcRow < rawHeight && srcCol < rawWidth)
+                entry.sources[entry.count++] = srcRow*rawWidth + srcCol;
+        }
+        gather.push_back(entry);
+        targets.push_back(entry.target);
+    }
+    std::sort(targets.begin(), targets.end());
+
+    // pixels reading other bad pixels and the ones read by them
+    std::vector<bool> dependent(gather.size(), false);
+    std::vector<uint32_t> readTargets;
+    for (size_t i = 0; i < gather.size(); ++i)
+        for (uint32_t k = 0; k < gather[i].count; ++k)
+            if (std::binary_search(targets.begin(), targets.end(), gather[i].sources[k]))
+            {
+                dependent[i] = true;
+                readTargets.push_back(gather[i].sources[k]);
+            }
+    std::sort(readTargets.begin(), readTargets.end());
+    for (size_t i = 0; i < gather.size(); ++i)
+    {
+        auto range = std::equal_range(targets.begin(), targets.end(), gather[i].target);
+        if (range.second - range.first > 1 ||
+            std::binary_search(readTargets.begin(), readTargets.end(), gather[i].target))
+            dependent[i] = true;
+    }
+
+    plan.defectGather.clear();
+    plan.defectGather.reserve(gather.size());
+    for (size_t i = 0; i < gather.size(); ++i)
+        if (!dependent[i])
+            plan.defectGather.push_back(gather[i]);
+    std::sort(plan.defectGather.begin(), plan.defectGather.end(),
+              [](const TDefectGather& a, const TDefectGather& b) { return a.target < b.target; });
+    plan.isolatedDefects = plan.defectGather.size();
+    for (size_t i = 0; i < gather.size(); ++i)
+        if (dependent[i])
+            plan.defectGather.push_back(gather[i]);
+
+    plan.dependentSorted = std::is_sorted(plan.defectGather.begin() + plan.isolatedDefects,
+                                          plan.defectGather.end(),
+        [rawWidth](const TDefectGather& a, const TDefectGather& b)
+        {
+            return std::make_pair(a.target % rawWidth, a.target / rawWidth) <
+                   std::make_pair(b.target % rawWidth, b.target / rawWidth);
+        });
+}
+
+inline void applyDefectGather(uint16_t* raw, const TDefectGather& entry)
+{
+    if (entry.count)
+    {
+        uint32_t sum = 0;
+        for (uint32_t k = 0; k < entry.count; ++k)
+            sum += raw[entry.sources[k]];
+        raw[entry.target] = (sum + (entry.count >> 1)) / entry.count;
+    }
+}
+
+// Bad column fixing kernels reach up to 4 rows/cols away - rows
+// further than that from the edges are fixed by the interior versions
+// without bounds checks in batches of BAD_COL_ROWS consecutive rows
+#define BAD_COL_REACH  4
+#define BAD_COL_ROWS   8
+
+// Averages sets for fixing pixels in bad column, none of them use
+// pixels in the same column
+static const int8_t colAvgSets[3][8][2] = {
+    { {-2,-2}, {-2, 2}, {2,-2}, {2, 2}, { 0, 0}, { 0, 0}, {0, 0}, {0, 0} },
+    { {-2,-4}, {-4,-2}, {2,-4}, {4,-2}, {-2, 4}, {-4, 2}, {2, 4}, {4, 2} },
+    { {-4,-4}, {-4, 4}, {4,-4}, {4, 4}, { 0, 0}, { 0, 0}, {0, 0}, {0, 0} } };
+
+// Gradient sets for fixing pixels in bad column - first pair is the
+// estimate, all six pairs are the gradient
+static const int8_t colGradSets[7][12][2] = {
+    { {-4,-2}, { 4, 2}, {-3,-1}, { 1, 1}, {-1,-1}, { 3, 1},
+      {-4,-1}, { 0, 1}, {-2,-1}, { 2, 1}, { 0,-1}, { 4, 1} },
+    { {-2,-2}, { 2, 2}, {-3,-1}, {-1, 1}, {-1,-1}, { 1, 1},
+      { 1,-1}, { 3, 1}, {-2,-1}, { 0, 1}, { 0,-1}, { 2, 1} },
+    { {-2,-4}, { 2, 4}, {-1,-3}, { 1, 1}, {-1,-1}, { 1, 3},
+      {-2,-1}, { 0, 3}, {-1,-2}, { 1, 2}, { 0,-3}, { 2, 1} },
+    { { 0,-2}, { 0, 2}, {-1,-1}, {-1, 1}, { 1,-1}, { 1, 1},
+      {-1,-2}, {-1, 2}, { 0,-1}, { 0,-1}, { 1,-2}, { 1, 2} },
+    { {-2, 4}, { 2,-4}, {-1, 3}, { 1,-1}, {-1, 1}, { 1,-3},
+      {-2, 1}, { 0,-3}, {-1, 2}, { 1,-2}, { 0, 3}, { 2,-1} },
+    { {-2, 2}, { 2,-2}, {-3, 1}, {-1,-1}, {-1, 1}, { 1,-1},
+      { 1, 1}, { 3,-1}, {-2, 1}, { 0,-1}, { 0, 1}, { 2,-1} },
+    { {-4, 2}, { 4,-2}, {-3, 1}, { 1,-1}, {-1, 1}, { 3,-1},
+      {-4, 1}, { 0,-1}, {-2, 1}, { 2,-1}, { 0, 1}, { 4,-1} } };
+
 // DNG SDK version of fixing pixels in bad column using averages sets
 // corrected not to use pixels in the same column
 void IIQFile::phase_one_fix_col_pixel_avg(unsigned row, unsigned col)
 {
-    static const int8_t dir[3][8][2] = {
-        { {-2,-2}, {-2, 2}, {2,-2}, {2, 2}, { 0, 0}, { 0, 0}, {0, 0}, {0, 0} },
-        { {-2,-4}, {-4,-2}, {2,-4}, {4,-2}, {-2, 4}, {-4, 2}, {2, 4}, {4, 2} },
-        { {-4,-4}, {-4, 4}, {4,-4}, {4, 4}, { 0, 0}, { 0, 0}, {0, 0}, {0, 0} } };
-
     for (int set=0; set < 3; ++set)
     {
         uint32_t total = 0;
         uint32_t count = 0;
         for (int i = 0; i < 8; ++i)
         {
-            if (!dir[set][i][0] && !dir[set][i][1])
+            if (!colAvgSets[set][i][0] && !colAvgSets[set][i][1])
                 break;
 
-            total += p1rawc(row+dir[set][i][0], col+dir[set][i][1], count);
+            total += p1rawc(row+colAvgSets[set][i][0], col+colAvgSets[set][i][1], count);
         }
 
         if (count)
@@ -1450,37 +2115,36 @@ void IIQFile::phase_one_fix_col_pixel_avg(unsigned row, unsigned col)
     }
 }
 
+// Interior version of the above for BAD_COL_ROWS rows starting at row -
+// all of the first set pixels are always present there
+void IIQFile::phase_one_fix_col_pixel_avg_inner(unsigned row, unsigned col)
+{
+    const ptrdiff_t width = imgdata.sizes.raw_width;
+    ptrdiff_t offs[4];
+    for (int i = 0; i < 4; ++i)
+        offs[i] = colAvgSets[0][i][0]*width + colAvgSets[0][i][1];
+
+    uint16_t* pixel = &RAW(row, col);
+    for (int k = 0; k < BAD_COL_ROWS; ++k, pixel += width)
+        *pixel = (uint16_t)((uint32_t(pixel[offs[0]]) + pixel[offs[1]] +
+                             pixel[offs[2]] + pixel[offs[3]] + 2) >> 2);
+}
+
 // DNG SDK version of fixing pixels in bad column using gradient prediction
 void IIQFile::phase_one_fix_pixel_grad(unsigned row, unsigned col)
 {
-    static const int8_t grad_sets[7][12][2] = {
-        { {-4,-2}, { 4, 2}, {-3,-1}, { 1, 1}, {-1,-1}, { 3, 1},
-          {-4,-1}, { 0, 1}, {-2,-1}, { 2, 1}, { 0,-1}, { 4, 1} },
-        { {-2,-2}, { 2, 2}, {-3,-1}, {-1, 1}, {-1,-1}, { 1, 1},
-          { 1,-1}, { 3, 1}, {-2,-1}, { 0, 1}, { 0,-1}, { 2, 1} },
-        { {-2,-4}, { 2, 4}, {-1,-3}, { 1, 1}, {-1,-1}, { 1, 3},
-          {-2,-1}, { 0, 3}, {-1,-2}, { 1, 2}, { 0,-3}, { 2, 1} },
-        { { 0,-2}, { 0, 2}, {-1,-1}, {-1, 1}, { 1,-1}, { 1, 1},
-          {-1,-2}, {-1, 2}, { 0,-1}, { 0,-1}, { 1,-2}, { 1, 2} },
-        { {-2, 4}, { 2,-4}, {-1, 3}, { 1,-1}, {-1, 1}, { 1,-3},
-          {-2, 1}, { 0,-3}, {-1, 2}, { 1,-2}, { 0, 3}, { 2,-1} },
-        { {-2, 2}, { 2,-2}, {-3, 1}, {-1,-1}, {-1, 1}, { 1,-1},
-          { 1, 1}, { 3,-1}, {-2, 1}, { 0,-1}, { 0, 1}, { 2,-1} },
-        { {-4, 2}, { 4,-2}, {-3, 1}, { 1,-1}, {-1, 1}, { 3,-1},
-          {-4, 1}, { 0,-1}, {-2, 1}, { 2,-1}, { 0, 1}, { 4,-1} } };
-
     uint32_t est[7], grad[7];
     uint32_t lower = min32(p1raw(row,col-2), p1raw(row, col+2));
     uint32_t upper = max32(p1raw(row,col-2), p1raw(row, col+2));
     uint32_t minGrad = 0xFFFFFFFF;
     for (int i = 0; i<7; ++i)
     {
-        est[i] = p1raw(row+grad_sets[i][0][0], col+grad_sets[i][0][1]) +
-                         p1raw(row+grad_sets[i][1][0], col+grad_sets[i][1][1]);
+        est[i] = p1raw(row+colGradSets[i][0][0], col+colGradSets[i][0][1]) +
+                         p1raw(row+colGradSets[i][1][0], col+colGradSets[i][1][1]);
         grad[i] = 0;
         for (int j=0; j<12; j+=2)
-            grad[i] += abs32(p1raw(row+grad_sets[i][j][0], col+grad_sets[i][j][1]) -
-                                             p1raw(row+grad_sets[i][j+1][0], col+grad_sets[i][j+1][1]));
+            grad[i] += abs32(p1raw(row+colGradSets[i][j][0], col+colGradSets[i][j][1]) -
+                                             p1raw(row+colGradSets[i][j+1][0], col+colGradSets[i][j+1][1]));
         minGrad = min32(minGrad, grad[i]);
     }
 
@@ -1496,313 +2160,1272 @@ void IIQFile::phase_one_fix_pixel_grad(unsigned row, unsigned col)
     RAW(row, col) = constrain((total + (count >> 1)) / count, lower, upper);
 }
 
-void IIQFile::phase_one_flat_field(int is_float, int nc)
+// Interior version of the above for BAD_COL_ROWS rows starting at row.
+// Works directly on pixel offsets and processes the rows together so
+// the inner loops can be vectorised.
+void IIQFile::phase_one_fix_pixel_grad_inner(unsigned row, unsigned col)
 {
-    ushort head[8];
-    unsigned wide, high, y, x, c, rend, cend, row, col;
-    float *mrow, num, mult[4];
+    const ptrdiff_t width = imgdata.sizes.raw_width;
+    ptrdiff_t offs[7][12];
+    for (int i = 0; i < 7; ++i)
+        for (int j = 0; j < 12; ++j)
+            offs[i][j] = colGradSets[i][j][0]*width + colGradSets[i][j][1];
 
-    getShorts(head, 8);
-    if (head[2] == 0 || head[3] == 0 || head[4] == 0 || head[5] == 0)
-        return;
-    wide = head[2] / head[4] + (head[2] % head[4] != 0);
-    high = head[3] / head[5] + (head[3] % head[5] != 0);
-    mrow = (float *)calloc(nc * wide, sizeof *mrow);
-    for (y = 0; y < high; ++y)
+    uint16_t* pixel = &RAW(row, col);
+    uint32_t est[7][BAD_COL_ROWS], grad[7][BAD_COL_ROWS];
+    uint32_t lower[BAD_COL_ROWS], upper[BAD_COL_ROWS], limit[BAD_COL_ROWS];
+
+    for (int k = 0; k < BAD_COL_ROWS; ++k)
     {
-        checkCancel();
-        for (x = 0; x < wide; x++)
-            for (c = 0; c < (unsigned)nc; c += 2)
-            {
-                num = is_float ? getFloat() : get16() / 32768.0;
-                if (y == 0)
-                    mrow[c * wide + x] = num;
-                else
-                    mrow[(c + 1) * wide + x] = (num - mrow[c * wide + x]) / head[5];
-            }
-        if (y == 0)
-            continue;
-        rend = head[1] + y * head[5];
-        for (row = rend - head[5];
-             row < imgdata.sizes.raw_height && row < rend && row < unsigned(head[1] + head[3] - head[5]);
-             row++)
+        const uint16_t* p = pixel + k*width;
+        lower[k] = min32(p[-2], p[2]);
+        upper[k] = max32(p[-2], p[2]);
+        limit[k] = 0xFFFFFFFF;
+    }
+
+    for (int i = 0; i < 7; ++i)
+    {
+        for (int k = 0; k < BAD_COL_ROWS; ++k)
         {
-            for (x = 1; x < wide; x++)
-            {
-                for (c = 0; c < (unsigned)nc; c += 2)
-                {
-                    mult[c] = mrow[c * wide + x - 1];
-                    mult[c + 1] = (mrow[c * wide + x] - mult[c]) / head[4];
-                }
-                cend = head[0] + x * head[4];
-                for (col = cend - head[4];
-                     col < imgdata.sizes.raw_width && col < cend && col < unsigned(head[0] + head[2] - head[4]);
-                     col++)
-                {
-                    c = nc > 2 ? FC(row - imgdata.sizes.top_margin, col - imgdata.sizes.left_margin) : 0;
-                    if (!(c & 1))
-                    {
-                        c = RAW(row, col) * mult[c];
-                        RAW(row, col) = constrain(c, 0u, 65535u);
-                    }
-                    for (c = 0; c < (unsigned)nc; c += 2)
-                        mult[c] += mult[c + 1];
-                }
-            }
-            for (x = 0; x < wide; x++)
-                for (c = 0; c < (unsigned)nc; c += 2)
-                    mrow[c * wide + x] += mrow[(c + 1) * wide + x];
+            const uint16_t* p = pixel + k*width;
+            est[i][k] = uint32_t(p[offs[i][0]]) + p[offs[i][1]];
+            grad[i][k] = abs32(int32_t(p[offs[i][0]]) - p[offs[i][1]]) +
+                         abs32(int32_t(p[offs[i][2]]) - p[offs[i][3]]) +
+                         abs32(int32_t(p[offs[i][4]]) - p[offs[i][5]]) +
+                         abs32(int32_t(p[offs[i][6]]) - p[offs[i][7]]) +
+                         abs32(int32_t(p[offs[i][8]]) - p[offs[i][9]]) +
+                         abs32(int32_t(p[offs[i][10]]) - p[offs[i][11]]);
+            limit[k] = min32(limit[k], grad[i][k]);
         }
     }
-    free(mrow);
-}
 
-// This is essentially a copy of LibRaw phase_one_correct but without defects fixing
-int IIQFile::phase_one_correct(bool applyDefects)
-{
-    unsigned entries, tag, data, save, col, row, type;
-    int len, i, j, k, cip, val[4], dev[4], sum, max;
-    int head[9], diff, mindiff = INT_MAX, off_412 = 0;
-    const signed char dir[12][2] = {
-            {-1, -1}, {-1, 1}, {1, -1},  {1, 1},  {-2, 0}, {0, -2},
-            {0, 2},   {2, 0},  {-2, -2}, {-2, 2}, {2, -2}, {2, 2}};
-    float poly[8], num, cfrac, frac, mult[2];
-    ushort *xval[2];
-    int qmult_applied = 0, qlin_applied = 0;
-    std::vector<unsigned> badCols;
+    for (int k = 0; k < BAD_COL_ROWS; ++k)
+    {
+        uint32_t minGrad = limit[k];
+        limit[k] = (minGrad * 3) >> 1;
+    }
 
-    if (!calData_ || !calDataEnd_ || calDataEnd_ - calData_ == 0)
-        return 0;
-    dataSetPos(0);
-    convEndian_ = (get32() == IIQ_BIGENDIAN);
-    dataSetPos(4, true);
-    dataSetPos(get32());
-    entries = get32();
-    get32();
+    uint32_t total[BAD_COL_ROWS] = { 0 };
+    uint32_t count[BAD_COL_ROWS] = { 0 };
+    for (int i = 0; i < 7; ++i)
+        for (int k = 0; k < BAD_COL_ROWS; ++k)
+        {
+            uint32_t use = grad[i][k] <= limit[k];
+            total[k] += est[i][k] * use;
+            count[k] += use << 1;
+        }
 
-    try
+    for (int k = 0; k < BAD_COL_ROWS; ++k)
+        pixel[k*width] = constrain((total[k] + (count[k] >> 1)) / count[k], lower[k], upper[k]);
+}
+
+// Fixes bad columns within [colStart, colEnd) for the rows in
+// [rowStart, rowEnd). The badCols must be the full sorted list as
+// the fixing method depends on neighbouring bad columns.
+void IIQFile::phase_one_fix_bad_cols(const std::vector<unsigned>& badCols,
+                                     unsigned colStart, unsigned colEnd,
+                                     unsigned rowStart, unsigned rowEnd)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+
+    // rows where all kernel pixels are inside the raw
+    const unsigned innerStart = std::max(rowStart, unsigned(BAD_COL_REACH));
+    const unsigned innerEnd = rawHeight > 2*BAD_COL_REACH
+                                ? std::min(rowEnd, rawHeight-BAD_COL_REACH)
+                                : 0;
+
+    bool prevIsolated = true;
+    for (size_t i = 0; i < badCols.size(); ++i)
     {
-        while (entries--)
+        const unsigned col = badCols[i];
+        const bool nextIsolated = i == badCols.size()-1 || badCols[i+1]>col+4;
+        const bool useGrad = prevIsolated && nextIsolated;
+        const bool innerCol = col >= BAD_COL_REACH && col+BAD_COL_REACH < rawWidth;
+        prevIsolated = nextIsolated;
+
+        if (col < colStart || col >= colEnd)
+            continue;
+
+        // Columns need fixing in order as they may use already fixed
+        // neighbouring columns but the rows of each column only use
+        // other columns and are fixed in parallel
+        tbb::parallel_for(tbb::blocked_range<unsigned>(rowStart, rowEnd, 16*BAD_COL_ROWS),
+        [&](const tbb::blocked_range<unsigned>& rows)
         {
-            checkCancel();
-            tag = get32();
-            len = get32();
-            data = get32();
-            save = dataGetPos();
-            dataSetPos(data);
-            if (tag == CAL_DefectCorrection && applyDefects)
-            { /* Sensor defects */
-                while ((len -= 8) >= 0)
+            unsigned row = rows.begin();
+            while (row < rows.end())
+            {
+                if (innerCol && row >= innerStart &&
+                    row+BAD_COL_ROWS <= std::min(rows.end(), innerEnd))
+                {
+                    if (useGrad)
+                        phase_one_fix_pixel_grad_inner(row, col);
+                    else
+                        phase_one_fix_col_pixel_avg_inner(row, col);
+                    row += BAD_COL_ROWS;
+                }
+                else
+                {
+                    if (useGrad)
+                        phase_one_fix_pixel_grad(row, col);
+                    else
+                        phase_one_fix_col_pixel_avg(row, col);
+                    ++row;
+                }
+            }
+        });
+    }
+}
+
+TRawRect IIQFile::applyDefectCorrLocal(const IIQCalFile& calFile, bool sensorPlus, int col, int row)
+{
+    TRawRect area;
+    const int rawWidth = imgdata.sizes.raw_width;
+    const int rawHeight = imgdata.sizes.raw_height;
+
+    if (!is_phaseone_compressed() || !imgdata.rawdata.raw_image ||
+        imgdata.rawdata.raw_image == imgdata.rawdata.raw_alloc ||
+        !preDefectKept_ ||
+        col < 0 || col >= rawWidth || row >= rawHeight)
+        return area;
+
+    const auto& defPixels = calFile.getDefectPixels(sensorPlus);
+    std::vector<unsigned> badCols;
+    for (auto defCol: calFile.getDefectCols(sensorPlus))
+        if (defCol < rawWidth)
+            badCols.push_back(defCol);
+
+    // Refixing the edited defect changes what the defects around read
+    // so the area grows until it covers all the defects reading changed
+    // pixels. Pixel fix reaches its 5x5 neighbourhood, bad columns reach
+    // BAD_COL_REACH pixels and are refixed over the whole height once
+    // in reach of the area.
+    int colStart = col, colEnd = col+1;
+    int rowStart = row < 0 ? 0 : row, rowEnd = row < 0 ? rawHeight : row+1;
+    bool grown = true;
+    auto include = [&](int cStart, int cEnd, int rStart, int rEnd)
+    {
+        cStart = std::max(cStart, 0);
+        cEnd = std::min(cEnd, rawWidth);
+        rStart = std::max(rStart, 0);
+        rEnd = std::min(rEnd, rawHeight);
+        if (cStart < colStart || cEnd > colEnd || rStart < rowStart || rEnd > rowEnd)
+        {
+            colStart = std::min(colStart, cStart);
+            colEnd = std::max(colEnd, cEnd);
+            rowStart = std::min(rowStart, rStart);
+            rowEnd = std::max(rowEnd, rEnd);
+            grown = true;
+        }
+    };
+
+    while (grown)
+    {
+        grown = false;
+        for (unsigned badCol: badCols)
+            if (int(badCol) + BAD_COL_REACH >= colStart && int(badCol) < colEnd + BAD_COL_REACH)
+                include(badCol, badCol+1, 0, rawHeight);
+
+        for (auto it = defPixels.lower_bound({colStart-2, INT_MIN});
+             it != defPixels.end() && it->first < colEnd+2;
+             ++it)
+        {
+            if (it->second >= rowStart-2 && it->second < rowEnd+2)
+                include(it->first, it->first+1, it->second, it->second+1);
+        }
+    }
+
+    area = { colStart, rowStart, colEnd-colStart, rowEnd-rowStart };
+
+    // restore pixels overwritten by defect fixing, the rest of the area
+    // still has its pre-defect values
+    for (int rw = area.row; rw < area.row + area.height; ++rw)
+    {
+        const uint32_t rowOffset = uint32_t(rw)*rawWidth;
+        for (auto it = preDefectPixels_.lower_bound(rowOffset + area.col);
+             it != preDefectPixels_.end() && it->first < rowOffset + area.col + area.width;
+             ++it)
+            imgdata.rawdata.raw_image[it->first] = it->second;
+    }
+    for (auto it = preDefectCols_.lower_bound(area.col);
+         it != preDefectCols_.end() && int(it->first) < area.col + area.width;
+         ++it)
+        for (int rw = area.row; rw < area.row + area.height; ++rw)
+            RAW(rw, it->first) = it->second[rw];
+
+    // defects added by the edit are kept before being fixed, bad
+    // columns in the area are always restored over the whole height
+    for (auto it = defPixels.lower_bound({area.col, INT_MIN});
+         it != defPixels.end() && it->first < area.col + area.width;
+         ++it)
+    {
+        if (it->second >= area.row && it->second < area.row + area.height)
+            preDefectPixels_.emplace(uint32_t(it->second)*rawWidth + it->first,
+                                     RAW(it->second, it->first));
+    }
+    for (unsigned badCol: badCols)
+        if (int(badCol) >= area.col && int(badCol) < area.col + area.width &&
+            !preDefectCols_.count(badCol))
+            keepPreDefectCol(badCol);
+
+    // Bad pixels in the area are fixed in the order of the full
+    // correction - the area holds every pixel the ones in it read or
+    // are read by, so compiling just these keeps the same dependent
+    // ones. Calibration with edits lists them by column then row.
+    std::vector<std::pair<unsigned,unsigned>> badPixels;
+    for (auto it = defPixels.lower_bound({area.col, INT_MIN});
+         it != defPixels.end() && it->first < area.col + area.width;
+         ++it)
+    {
+        if (it->second >= area.row && it->second < area.row + area.height)
+            badPixels.emplace_back(it->second, it->first);
+    }
+    TCorrPlan plan;
+    phase_one_compile_defects(plan, badPixels);
+    for (const auto& entry: plan.defectGather)
+        applyDefectGather(imgdata.rawdata.raw_image, entry);
+
+    // fix bad columns in the area
+    phase_one_fix_bad_cols(badCols, area.col, area.col + area.width,
+                           area.row, area.row + area.height);
+
+    return area;
+}
+
+void IIQFile::setKeepPreDefect(bool keep)
+{
+    keepPreDefect_ = keep;
+    if (!keep)
+        clearPreDefect();
+}
+
+void IIQFile::clearPreDefect()
+{
+    preDefectPixels_.clear();
+    preDefectCols_.clear();
+    preDefectKept_ = false;
+}
+
+void IIQFile::keepPreDefectCol(unsigned col)
+{
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+    auto& values = preDefectCols_[col];
+    values.resize(rawHeight);
+    for (unsigned row = 0; row < rawHeight; ++row)
+        values[row] = RAW(row, col);
+}
+
+// Tiled correction defaults - cache size shared by the bands processed
+// at the same time and the minimum rows in a band
+#define CORR_CACHE_SIZE     (8*1024*1024)
+#define CORR_MIN_BAND_ROWS  16
+
+// Frames corrected at the same time by the batch correction
+#define BATCH_FRAMES_IN_FLIGHT  4
+
+// Reads flat field grid and precomputes interpolation state for every
+// band of rows between grid rows exactly as sequential processing
+// would get it so bands of rows can be corrected independently
+bool IIQFile::phase_one_parse_flat_field(TCorrContext& ctx, TCorrStage& stage, int is_float, int nc)
+{
+    ushort* head = stage.head;
+    unsigned wide, high, y, x, c, rend, row;
+    float num;
+
+    ctx.getShorts(head, 8);
+    if (head[2] == 0 || head[3] == 0 || head[4] == 0 || head[5] == 0)
+        return false;
+    wide = head[2] / head[4] + (head[2] % head[4] != 0);
+    high = head[3] / head[5] + (head[3] % head[5] != 0);
+    std::vector<float> mrow(nc * wide, 0.0f);
+
+    stage.type = TCorrStage::ST_FLAT_FIELD;
+    stage.nc = nc;
+    stage.wide = wide;
+    for (y = 0; y < high; ++y)
+    {
+        checkCancel();
+        for (x = 0; x < wide; x++)
+            for (c = 0; c < (unsigned)nc; c += 2)
+            {
+                num = is_float ? ctx.getFloat() : ctx.get16() / 32768.0;
+                if (y == 0)
+                    mrow[c * wide + x] = num;
+                else
+                    mrow[(c + 1) * wide + x] = (num - mrow[c * wide + x]) / head[5];
+            }
+        if (y == 0)
+            continue;
+        rend = head[1] + y * head[5];
+
+        TFlatFieldBand band;
+        band.rowStart = rend - head[5];
+        band.rowEnd = std::max(band.rowStart,
+                               std::min({ unsigned(imgdata.sizes.raw_height), rend,
+                                          unsigned(head[1] + head[3] - head[5]) }));
+        band.mrow = mrow;
+        for (row = band.rowStart; row < band.rowEnd; row++)
+            for (x = 0; x < wide; x++)
+                for (c = 0; c < (unsigned)nc; c += 2)
+                    mrow[c * wide + x] += mrow[(c + 1) * wide + x];
+        stage.ffBands.push_back(std::move(band));
+    }
+    return true;
+}
+
+// Applies flat field to rows in [rowStart, rowEnd) held from raw on,
+// returns number of pixels processed
+size_t IIQFile::phase_one_flat_field(const TCorrStage& stage, uint16_t* raw,
+                                     unsigned rowStart, unsigned rowEnd)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned wide = stage.wide;
+    const unsigned nc = stage.nc;
+    unsigned x, c, row;
+    std::vector<float> mrow;
+    size_t pixels = 0;
+
+    for (const auto& band: stage.ffBands)
+    {
+        if (band.rowEnd <= rowStart || band.rowStart >= rowEnd)
+            continue;
+
+        // bring the interpolation to the first row needed
+        mrow = band.mrow;
+        for (row = band.rowStart; row < rowStart; row++)
+            for (x = 0; x < wide; x++)
+                for (c = 0; c < nc; c += 2)
+                    mrow[c * wide + x] += mrow[(c + 1) * wide + x];
+
+        dispatchCFA(cfaPattern(), [&](auto cfa)
+        {
+            for (; row < band.rowEnd && row < rowEnd; row++)
+            {
+                uint16_t* pixel = raw + size_t(row - rowStart)*rawWidth;
+                pixels += fixedFlatField_
+                            ? flatFieldRowFixed(pixel, rawWidth, stage.head, wide, nc, mrow.data(),
+                                                row - imgdata.sizes.top_margin,
+                                                imgdata.sizes.left_margin, cfa)
+                            : flatFieldRow(pixel, rawWidth, stage.head, wide, nc, mrow.data(),
+                                           row - imgdata.sizes.top_margin,
+                                           imgdata.sizes.left_margin, cfa);
+                for (x = 0; x < wide; x++)
+                    for (c = 0; c < nc; c += 2)
+                        mrow[c * wide + x] += mrow[(c + 1) * wide + x];
+            }
+        });
+    }
+    return pixels;
+}
+
+// Applies single correction stage to rows in [rowStart, rowEnd) held
+// from rows on, returns number of pixels processed
+size_t IIQFile::phase_one_apply_stage(const TCorrStage& stage, uint16_t* raw,
+                                      unsigned rowStart, unsigned rowEnd)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned splitCol = std::min(unsigned(ph1.split_col), rawWidth);
+    const size_t rows = rowEnd > rowStart ? rowEnd - rowStart : 0;
+
+    switch (stage.type)
+    {
+        case TCorrStage::ST_CURVE:
+            for (unsigned row = rowStart; row < rowEnd; ++row)
+            {
+                uint16_t* pixel = raw + size_t(row - rowStart)*rawWidth;
+                for (unsigned col = stage.startCol; col < rawWidth; ++col)
+                    pixel[col] = stage.curves[pixel[col]];
+            }
+            return stage.startCol < rawWidth ? rows*(rawWidth - stage.startCol) : 0;
+
+        case TCorrStage::ST_QUAD_CURVES:
+            for (unsigned row = rowStart; row < rowEnd; ++row)
+            {
+                uint16_t* pixel = raw + size_t(row - rowStart)*rawWidth;
+                const uint16_t* curve = stage.curves.data() + (row >= unsigned(ph1.split_row))*0x20000;
+                unsigned col = 0;
+                for (; col < splitCol; ++col)
+                    pixel[col] = curve[pixel[col]];
+                for (curve += 0x10000; col < rawWidth; ++col)
+                    pixel[col] = curve[pixel[col]];
+            }
+            return rows*rawWidth;
+
+        case TCorrStage::ST_QUAD_MULT:
+            for (unsigned row = rowStart; row < rowEnd; ++row)
+            {
+                uint16_t* pixel = raw + size_t(row - rowStart)*rawWidth;
+                const float* qmult = stage.qmult[row >= unsigned(ph1.split_row)];
+                unsigned col = 0;
+                for (; col < splitCol; ++col)
                 {
-                    col = get16();
-                    row = get16();
-                    type = get16();
-                    get16();
-                    if (col >= imgdata.sizes.raw_width)
+                    int i = qmult[0] * pixel[col];
+                    pixel[col] = constrain(i, 0, 65535);
+                }
+                for (; col < rawWidth; ++col)
+                {
+                    int i = qmult[1] * pixel[col];
+                    pixel[col] = constrain(i, 0, 65535);
+                }
+            }
+            return rows*rawWidth;
+
+        case TCorrStage::ST_FLAT_FIELD:
+            return phase_one_flat_field(stage, raw, rowStart, rowEnd);
+    }
+    return 0;
+}
+
+// Stats entry for the correction stage
+static TCorrStats::EStage corrStatsStage(const TCorrStage& stage)
+{
+    switch (stage.type)
+    {
+        case TCorrStage::ST_CURVE:
+            return TCorrStats::CS_CURVE;
+        case TCorrStage::ST_QUAD_CURVES:
+            return TCorrStats::CS_QUAD_LUT;
+        case TCorrStage::ST_QUAD_MULT:
+            return TCorrStats::CS_QUAD_MULT;
+        case TCorrStage::ST_FLAT_FIELD:
+            break;
+    }
+    return TCorrStats::CS_FLAT_FIELD;
+}
+
+// Reentrant version of LibRaw cubic_spline writing into the given curve
+// instead of the shared LibRaw one
+static void cubicSpline(const int *x_, const int *y_, const int len, uint16_t* curve)
+{
+    // matrix followed by b, c, d, x and y vectors
+    std::vector<float> data(4*len*len + 8*len, 0.0f);
+    std::vector<float*> A(2*len);
+    int i, j;
+
+    for (i = 0; i < 2*len; i++)
+        A[i] = data.data() + 2*len*i;
+    float *b = data.data() + 4*len*len;
+    float *c = b + 2*len;
+    float *d = c + 2*len;
+    float *x = d + 2*len;
+    float *y = x + len;
+
+    for (i = 0; i < len; i++)
+    {
+        x[i] = x_[i] / 65535.0;
+        y[i] = y_[i] / 65535.0;
+    }
+    for (i = len - 1; i > 0; i--)
+    {
+        b[i] = (y[i] - y[i - 1]) / (x[i] - x[i - 1]);
+        d[i - 1] = x[i] - x[i - 1];
+    }
+    for (i = 1; i < len - 1; i++)
+    {
+        A[i][i] = 2 * (d[i - 1] + d[i]);
+        if (i > 1)
+        {
+            A[i][i - 1] = d[i - 1];
+            A[i - 1][i] = d[i - 1];
+        }
+        A[i][len - 1] = 6 * (b[i + 1] - b[i]);
+    }
+    for (i = 1; i < len - 2; i++)
+    {
+        float v = A[i + 1][i] / A[i][i];
+        for (j = 1; j <= len - 1; j++)
+            A[i + 1][j] -= v * A[i][j];
+    }
+    for (i = len - 2; i > 0; i--)
+    {
+        float acc = 0;
+        for (j = i; j <= len - 2; j++)
+            acc += A[i][j] * c[j];
+        c[i] = (A[i][len - 1] - acc) / A[i][i];
+    }
+    for (i = 0; i < 0x10000; i++)
+    {
+        float x_out = (float)(i / 65535.0);
+        float y_out = 0;
+        for (j = 0; j < len - 1; j++)
+        {
+            if (x[j] <= x_out && x_out <= x[j + 1])
+            {
+                float v = x_out - x[j];
+                y_out = y[j] +
+                        ((y[j + 1] - y[j]) / d[j] - (2 * d[j] + d[j + 1]) * c[j] / 6 - d[j] * c[j + 1] / 6) * v +
+                        (c[j] * 0.5) * v * v + ((c[j + 1] - c[j]) / (6 * d[j])) * v * v * v;
+            }
+        }
+        curve[i] = y_out < 0.0 ? 0 : (y_out >= 1.0 ? 65535 : (ushort)(y_out * 65535.0 + 0.5));
+    }
+}
+
+// Reads all the corrections from calibration data without applying them
+void IIQFile::phase_one_parse_corr(TCorrContext& ctx, bool applyDefects)
+{
+    TCorrPlan& plan = ctx.plan;
+    unsigned entries, tag, data, save, col, row, type;
+    int len, i, j;
+    float poly[8], num;
+    int qmult_applied = 0, qlin_applied = 0;
+    std::vector<std::pair<unsigned,unsigned>> badPixels;
+
+    ctx.dataSetPos(0);
+    ctx.convEndian = (ctx.get32() == IIQ_BIGENDIAN);
+    ctx.dataSetPos(4, true);
+    ctx.dataSetPos(ctx.get32());
+    entries = ctx.get32();
+    ctx.get32();
+
+    while (entries--)
+    {
+        checkCancel();
+        tag = ctx.get32();
+        len = ctx.get32();
+        data = ctx.get32();
+        save = ctx.dataGetPos();
+        ctx.dataSetPos(data);
+        if (tag == CAL_DefectCorrection && applyDefects)
+        { /* Sensor defects */
+            while ((len -= 8) >= 0)
+            {
+                col = ctx.get16();
+                row = ctx.get16();
+                type = ctx.get16();
+                ctx.get16();
+                if (col >= imgdata.sizes.raw_width)
+                    continue;
+                if (type == 131 || type == 137) /* Bad column */
+                    plan.badCols.push_back(col);
+                else if (type == 129)
+                { /* Bad pixel */
+                    if (row >= imgdata.sizes.raw_height)
                         continue;
-                    if (type == 131 || type == 137) /* Bad column */
-                        badCols.push_back(col);
-                    else if (type == 129)
-                    { /* Bad pixel */
-                        if (row >= imgdata.sizes.raw_height)
-                            continue;
-                        j = (FC(row - imgdata.sizes.top_margin, col - imgdata.sizes.left_margin) != 1) * 4;
-                        unsigned count = 0;
-                        for (sum = 0, i = j; i < j + 8; i++)
-                            sum += p1rawc(row + dir[i][0], col + dir[i][1], count);
-                        if (count)
-                            RAW(row, col) = (sum + (count >> 1)) / count;
-                    }
+                    badPixels.emplace_back(row, col);
                 }
             }
-            else if (tag == CAL_DualOutputPoly)
-            { /* Polynomial curve */
-                for (get32(), i = 0; i < 8; i++)
-                    poly[i] = getFloat();
+        }
+        else if (tag == CAL_DualOutputPoly || tag == CAL_PolynomialCurve)
+        { /* Polynomial curve */
+            TCorrStage stage;
+            stage.type = TCorrStage::ST_CURVE;
+            stage.curves.resize(0x10000);
+            if (tag == CAL_DualOutputPoly)
+            {
+                for (ctx.get32(), i = 0; i < 8; i++)
+                    poly[i] = ctx.getFloat();
                 poly[3] += (ph1.tag_210 - poly[7]) * poly[6] + 1;
                 for (i = 0; i < 0x10000; i++)
                 {
                     num = (poly[5] * i + poly[3]) * i + poly[1];
-                    imgdata.color.curve[i] = constrain((int)num, 0, 65535);
+                    stage.curves[i] = constrain((int)num, 0, 65535);
                 }
-                goto apply; /* apply to right half */
+                /* apply to right half */
+                stage.startCol = ph1.split_col;
             }
-            else if (tag == CAL_PolynomialCurve)
-            { /* Polynomial curve */
+            else
+            {
                 for (i = 0; i < 4; i++)
-                    poly[i] = getFloat();
+                    poly[i] = ctx.getFloat();
                 for (i = 0; i < 0x10000; i++)
                 {
                     for (num = 0, j = 4; j--;)
                         num = num * i + poly[j];
-                    imgdata.color.curve[i] = constrain((int)(num + i), 0, 65535);
-                }
-            apply: /* apply to whole image */
-                for (row = 0; row < imgdata.sizes.raw_height; row++)
-                {
-                    checkCancel();
-                    for (col = (tag & 1) * ph1.split_col;
-                         col < imgdata.sizes.raw_width;
-                         ++col)
-                        RAW(row, col) = imgdata.color.curve[RAW(row, col)];
+                    stage.curves[i] = constrain((int)(num + i), 0, 65535);
                 }
             }
-            else if (tag == CAL_LumaAllColourFlatField)
-            { /* All-color flat fields */
-                phase_one_flat_field(1, 2);
-            }
-            else if (tag == CAL_LumaFlatField2 || tag == CAL_Luma)
-            {
-                phase_one_flat_field(0, 2);
-            }
-            else if (tag == CAL_ChromaRedBlue)
-            { /* Red+blue flat field */
-                phase_one_flat_field(0, 4);
-            }
-            else if (tag == CAL_XYZCorrection)
+            plan.stages.push_back(std::move(stage));
+        }
+        else if (tag == CAL_LumaAllColourFlatField ||
+                 tag == CAL_LumaFlatField2 || tag == CAL_Luma ||
+                 tag == CAL_ChromaRedBlue)
+        { /* Flat fields */
+            TCorrStage stage;
+            if (phase_one_parse_flat_field(ctx, stage,
+                                           tag == CAL_LumaAllColourFlatField,
+                                           tag == CAL_ChromaRedBlue ? 4 : 2))
+                plan.stages.push_back(std::move(stage));
+        }
+        else if (tag == CAL_XYZCorrection)
+        {
+            // XYZ corrections are not supported - they are stored outside
+            // of cal file and is one of P1 weirdness
+        }
+        else if (tag == CAL_FourTileLinearisation && !qlin_applied)
+        { /* Quadrant linearization */
+            ushort lc[2][2][16], ref[16];
+            int qr, qc;
+            for (qr = 0; qr < 2; qr++)
+                for (qc = 0; qc < 2; qc++)
+                    for (i = 0; i < 16; i++)
+                        lc[qr][qc][i] = ctx.get32();
+            for (i = 0; i < 16; i++)
             {
-                // XYZ corrections are not supported - they are stored outside
-                // of cal file and is one of P1 weirdness
-            }
-            else if (tag == CAL_FourTileLinearisation && !qlin_applied)
-            { /* Quadrant linearization */
-                ushort lc[2][2][16], ref[16];
-                int qr, qc;
+                int v = 0;
                 for (qr = 0; qr < 2; qr++)
                     for (qc = 0; qc < 2; qc++)
-                        for (i = 0; i < 16; i++)
-                            lc[qr][qc][i] = get32();
-                for (i = 0; i < 16; i++)
-                {
-                    int v = 0;
-                    for (qr = 0; qr < 2; qr++)
-                        for (qc = 0; qc < 2; qc++)
-                            v += lc[qr][qc][i];
-                    ref[i] = (v + 2) >> 2;
-                }
-                for (qr = 0; qr < 2; qr++)
-                {
-                    for (qc = 0; qc < 2; qc++)
-                    {
-                        int cx[19], cf[19];
-                        for (i = 0; i < 16; i++)
-                        {
-                            cx[1 + i] = lc[qr][qc][i];
-                            cf[1 + i] = ref[i];
-                        }
-                        cx[0] = cf[0] = 0;
-                        cx[17] = cf[17] = ((unsigned int)ref[15] * 65535) / lc[qr][qc][15];
-                        cf[18] = cx[18] = 65535;
-                        cubic_spline(cx, cf, 19);
-
-                        for (row = (qr ? ph1.split_row : 0);
-                             row < unsigned(qr ? imgdata.sizes.raw_height : ph1.split_row);
-                             ++row)
-                        {
-                            checkCancel();
-                            for (col = (qc ? ph1.split_col : 0);
-                                 col < unsigned(qc ? imgdata.sizes.raw_width : ph1.split_col);
-                                 ++col)
-                                RAW(row, col) = imgdata.color.curve[RAW(row, col)];
-                        }
-                    }
-                }
-                qlin_applied = 1;
+                        v += lc[qr][qc][i];
+                ref[i] = (v + 2) >> 2;
             }
-            else if (tag == CAL_FourTileOutput && !qmult_applied)
-            { /* Quadrant multipliers */
-                float qmult[2][2] = {{1, 1}, {1, 1}};
-                get32();
-                get32();
-                get32();
-                get32();
-                qmult[0][0] = 1.0 + getFloat();
-                get32();
-                get32();
-                get32();
-                get32();
-                get32();
-                qmult[0][1] = 1.0 + getFloat();
-                get32();
-                get32();
-                get32();
-                qmult[1][0] = 1.0 + getFloat();
-                get32();
-                get32();
-                get32();
-                qmult[1][1] = 1.0 + getFloat();
-                for (row = 0; row < imgdata.sizes.raw_height; ++row)
+            TCorrStage stage;
+            stage.type = TCorrStage::ST_QUAD_CURVES;
+            stage.curves.resize(4*0x10000);
+            for (qr = 0; qr < 2; qr++)
+            {
+                for (qc = 0; qc < 2; qc++)
                 {
-                    checkCancel();
-                    for (col = 0; col < imgdata.sizes.raw_width; ++col)
+                    int cx[19], cf[19];
+                    for (i = 0; i < 16; i++)
                     {
-                        i = qmult[row >= (unsigned)ph1.split_row][col >= (unsigned)ph1.split_col] *
-                                RAW(row, col);
-                        RAW(row, col) = constrain(i, 0, 65535);
+                        cx[1 + i] = lc[qr][qc][i];
+                        cf[1 + i] = ref[i];
                     }
+                    cx[0] = cf[0] = 0;
+                    cx[17] = cf[17] = ((unsigned int)ref[15] * 65535) / lc[qr][qc][15];
+                    cf[18] = cx[18] = 65535;
+                    cubicSpline(cx, cf, 19, stage.curves.data() + (qr*2 + qc)*0x10000);
                 }
-                qmult_applied = 1;
             }
-            else if (tag == CAL_FourTileGainLUT && !qmult_applied)
-            { /* Quadrant combined */
-                ushort lc[2][2][7], ref[7];
-                int qr, qc;
-                for (i = 0; i < 7; i++)
-                    ref[i] = get32();
-                for (qr = 0; qr < 2; qr++)
-                    for (qc = 0; qc < 2; qc++)
-                        for (i = 0; i < 7; i++)
-                            lc[qr][qc][i] = get32();
-                for (qr = 0; qr < 2; qr++)
+            plan.stages.push_back(std::move(stage));
+            qlin_applied = 1;
+        }
+        else if (tag == CAL_FourTileOutput && !qmult_applied)
+        { /* Quadrant multipliers */
+            TCorrStage stage;
+            stage.type = TCorrStage::ST_QUAD_MULT;
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            stage.qmult[0][0] = 1.0 + ctx.getFloat();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            stage.qmult[0][1] = 1.0 + ctx.getFloat();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            stage.qmult[1][0] = 1.0 + ctx.getFloat();
+            ctx.get32();
+            ctx.get32();
+            ctx.get32();
+            stage.qmult[1][1] = 1.0 + ctx.getFloat();
+            plan.stages.push_back(std::move(stage));
+            qmult_applied = 1;
+        }
+        else if (tag == CAL_FourTileGainLUT && !qmult_applied)
+        { /* Quadrant combined */
+            ushort lc[2][2][7], ref[7];
+            int qr, qc;
+            for (i = 0; i < 7; i++)
+                ref[i] = ctx.get32();
+            for (qr = 0; qr < 2; qr++)
+                for (qc = 0; qc < 2; qc++)
+                    for (i = 0; i < 7; i++)
+                        lc[qr][qc][i] = ctx.get32();
+            TCorrStage stage;
+            stage.type = TCorrStage::ST_QUAD_CURVES;
+            stage.curves.resize(4*0x10000);
+            for (qr = 0; qr < 2; qr++)
+            {
+                for (qc = 0; qc < 2; qc++)
                 {
-                    for (qc = 0; qc < 2; qc++)
+                    int cx[9], cf[9];
+                    for (i = 0; i < 7; i++)
                     {
-                        int cx[9], cf[9];
-                        for (i = 0; i < 7; i++)
-                        {
-                            cx[1 + i] = ref[i];
-                            cf[1 + i] = ((unsigned)ref[i] * lc[qr][qc][i]) / 10000;
-                        }
-                        cx[0] = cf[0] = 0;
-                        cx[8] = cf[8] = 65535;
-                        cubic_spline(cx, cf, 9);
-                        for (row = (qr ? ph1.split_row : 0);
-                             row < unsigned(qr ? imgdata.sizes.raw_height : ph1.split_row);
-                             ++row)
-                        {
-                            checkCancel();
-                            for (col = (qc ? ph1.split_col : 0);
-                                 col < unsigned(qc ? imgdata.sizes.raw_width : ph1.split_col);
-                                 ++col)
-                                RAW(row, col) = imgdata.color.curve[RAW(row, col)];
-                        }
+                        cx[1 + i] = ref[i];
+                        cf[1 + i] = ((unsigned)ref[i] * lc[qr][qc][i]) / 10000;
                     }
+                    cx[0] = cf[0] = 0;
+                    cx[8] = cf[8] = 65535;
+                    cubicSpline(cx, cf, 9, stage.curves.data() + (qr*2 + qc)*0x10000);
                 }
-                qmult_applied = 1;
-                qlin_applied = 1;
             }
-            dataSetPos(save);
+            plan.stages.push_back(std::move(stage));
+            qmult_applied = 1;
+            qlin_applied = 1;
+        }
+        ctx.dataSetPos(save);
+    }
+
+    // bad column fixing needs them in order
+    std::sort(plan.badCols.begin(), plan.badCols.end());
+    phase_one_compile_defects(plan, badPixels);
+}
+
+inline void subtractBlackSpan(const uint16_t* src, uint16_t* dest, const int16_t* colBlack,
+                              int rowBlack, unsigned colStart, unsigned colEnd)
+{
+    for (unsigned col = colStart; col < colEnd; ++col)
+    {
+        int val = int(src[col]) + rowBlack + colBlack[col];
+        dest[col] = val > 0 ? val : 0;
+    }
+}
+
+// Black set by user in LibRaw params overrides black levels from the raw
+bool IIQFile::phase_one_user_black() const
+{
+    return imgdata.params.user_black >= 0 ||
+           imgdata.params.user_cblack[0] > -1000000 ||
+           imgdata.params.user_cblack[1] > -1000000 ||
+           imgdata.params.user_cblack[2] > -1000000 ||
+           imgdata.params.user_cblack[3] > -1000000;
+}
+
+// Column black for rows above and below split row
+std::vector<int16_t> IIQFile::phase_one_col_black() const
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    std::vector<int16_t> colBlack(2*rawWidth, 0);
+    if (imgdata.rawdata.ph1_cblack && imgdata.rawdata.ph1_rblack)
+        for (unsigned col = 0; col < rawWidth; ++col)
+        {
+            colBlack[col] = imgdata.rawdata.ph1_rblack[col][0];
+            colBlack[rawWidth + col] = imgdata.rawdata.ph1_rblack[col][1];
+        }
+    return colBlack;
+}
+
+// Subtracts black from the original rows in [rowStart, rowEnd) held from
+// src on into the corrected ones from dest on. Same as LibRaw
+// phase_one_subtract_black using total black with per row and per column
+// levels from the black reference data read along with the raw.
+void IIQFile::phase_one_black_rows(const uint16_t* src, uint16_t* dest, const int16_t* colBlack,
+                                   unsigned rowStart, unsigned rowEnd)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const auto& ph1Data = imgdata.rawdata.color.phase_one_data;
+    const unsigned splitCol = std::min(unsigned(std::max(ph1Data.split_col, 0)), rawWidth);
+    const bool rowColBlack = imgdata.rawdata.ph1_cblack && imgdata.rawdata.ph1_rblack;
+
+    for (unsigned row = rowStart; row < rowEnd; ++row)
+    {
+        const size_t offset = size_t(row - rowStart)*rawWidth;
+        const int16_t* rowColBlk = colBlack + (row >= unsigned(ph1Data.split_row))*rawWidth;
+        int rowBlack[2] = { -ph1Data.t_black, -ph1Data.t_black };
+        if (rowColBlack)
+        {
+            rowBlack[0] += imgdata.rawdata.ph1_cblack[row][0];
+            rowBlack[1] += imgdata.rawdata.ph1_cblack[row][1];
         }
-        if (!badCols.empty())
+        subtractBlackSpan(src + offset, dest + offset, rowColBlk, rowBlack[0], 0, splitCol);
+        subtractBlackSpan(src + offset, dest + offset, rowColBlk, rowBlack[1], splitCol, rawWidth);
+    }
+}
+
+// Applies parsed corrections, subtracting black first if needed. In
+// tiled mode the raw is split into bands of rows sized so that bands
+// processed by all the threads fit in the cache together and every
+// stage is applied to the band before moving to the next one. Otherwise
+// each stage is applied to the whole raw.
+void IIQFile::phase_one_apply_corr(const TCorrPlan& plan, bool applyDefects, bool subtractBlack)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+
+    // stage stats collected from all the threads
+    std::atomic<int64_t> stageNs[TCorrStats::CS_COUNT] = {};
+    std::atomic<uint64_t> stagePixels[TCorrStats::CS_COUNT] = {};
+
+    auto applyStage = [&](const TCorrStage& stage, unsigned rowStart, unsigned rowEnd)
+    {
+        const auto start = TCorrClock::now();
+        const auto pixels = phase_one_apply_stage(stage, imgdata.rawdata.raw_image + size_t(rowStart)*rawWidth,
+                                                  rowStart, rowEnd);
+        const auto statsStage = corrStatsStage(stage);
+        stageNs[statsStage] += nsSince(start);
+        stagePixels[statsStage] += pixels;
+    };
+
+    std::vector<int16_t> colBlack;
+    if (subtractBlack)
+        colBlack = phase_one_col_black();
+
+    auto applyBlack = [&](unsigned rowStart, unsigned rowEnd)
+    {
+        const auto start = TCorrClock::now();
+        const size_t offset = size_t(rowStart)*rawWidth;
+        phase_one_black_rows((const uint16_t*)imgdata.rawdata.raw_alloc + offset,
+                             imgdata.rawdata.raw_image + offset, colBlack.data(), rowStart, rowEnd);
+        stageNs[TCorrStats::CS_BLACK] += nsSince(start);
+        stagePixels[TCorrStats::CS_BLACK] += size_t(rowEnd - rowStart)*rawWidth;
+    };
+
+    // Defects are fixed after all other corrections so the values they
+    // overwrite can be kept for local refixing after the edits. That
+    // fixes pixels in the order edited calibration has them so they are
+    // only kept when this one matches it.
+    const bool snapshot = applyDefects && keepPreDefect_ && plan.dependentSorted;
+    clearPreDefect();
+
+    if (tiledCorr_)
+    {
+        const size_t cacheSize = corrCacheSize_ ? corrCacheSize_ : CORR_CACHE_SIZE;
+        const size_t threads = std::max(tbb::this_task_arena::max_concurrency(), 1);
+        const unsigned bandRows = std::max(size_t(CORR_MIN_BAND_ROWS),
+                                           cacheSize / (threads*rawWidth*sizeof(uint16_t)));
+
+        tbb::parallel_for(tbb::blocked_range<unsigned>(0, rawHeight, bandRows),
+        [&](const tbb::blocked_range<unsigned>& rows)
         {
-            std::sort(badCols.begin(), badCols.end());
-            bool prevIsolated = true;
-            for (i = 0; i < badCols.size(); ++i)
+            checkCancel();
+            if (subtractBlack)
+                applyBlack(rows.begin(), rows.end());
+            for (const auto& stage: plan.stages)
+                applyStage(stage, rows.begin(), rows.end());
+        }, tbb::simple_partitioner());
+    }
+    else
+    {
+        if (subtractBlack)
+            tbb::parallel_for(tbb::blocked_range<unsigned>(0, rawHeight, CORR_MIN_BAND_ROWS),
+            [&](const tbb::blocked_range<unsigned>& rows)
             {
-                bool nextIsolated = i == badCols.size()-1 || badCols[i+1]>badCols[i]+4;
-                for (row = 0; row < imgdata.sizes.raw_height; ++row)
-                    if (prevIsolated && nextIsolated)
-                        phase_one_fix_pixel_grad(row,badCols[i]);
-                    else
-                        phase_one_fix_col_pixel_avg(row,badCols[i]);
-                prevIsolated = nextIsolated;
+                applyBlack(rows.begin(), rows.end());
+            });
+        for (const auto& stage: plan.stages)
+        {
+            checkCancel();
+            applyStage(stage, 0, rawHeight);
+        }
+    }
+
+    // Defect kernels reach into neighbouring bands and bad columns need
+    // fixing in order so they are done once all bands are corrected
+    if (applyDefects)
+    {
+        const auto start = TCorrClock::now();
+        const auto& gather = plan.defectGather;
+        uint16_t* raw = imgdata.rawdata.raw_image;
+        if (snapshot)
+        {
+            for (const auto& entry: gather)
+                preDefectPixels_.emplace(entry.target, raw[entry.target]);
+            for (unsigned col: plan.badCols)
+                keepPreDefectCol(col);
+            preDefectKept_ = true;
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, plan.isolatedDefects, 1024),
+        [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i < range.end(); ++i)
+                applyDefectGather(raw, gather[i]);
+        });
+        for (size_t i = plan.isolatedDefects; i < gather.size(); ++i)
+            applyDefectGather(raw, gather[i]);
+
+        if (!plan.badCols.empty())
+            phase_one_fix_bad_cols(plan.badCols, 0, rawWidth, 0, rawHeight);
+
+        stageNs[TCorrStats::CS_DEFECTS] += nsSince(start);
+        stagePixels[TCorrStats::CS_DEFECTS] += gather.size() + plan.badCols.size()*rawHeight;
+        corrStats_.defPixels = gather.size();
+        corrStats_.defCols = plan.badCols.size();
+    }
+
+    // every pixel processed is read and written
+    for (int i = TCorrStats::CS_BLACK; i < TCorrStats::CS_TOTAL; ++i)
+    {
+        if (i == TCorrStats::CS_PARSE || (i == TCorrStats::CS_BLACK && !subtractBlack))
+            continue;
+        corrStats_.time[i] = stageNs[i]/1e6;
+        corrStats_.bytes[i] = stagePixels[i]*2*sizeof(uint16_t);
+    }
+    std::fill(std::begin(corrStats_.stages), std::end(corrStats_.stages), 0);
+    for (const auto& stage: plan.stages)
+        ++corrStats_.stages[corrStatsStage(stage)];
+}
+
+// Parses corrections from the calibration data for this raw, returns
+// nothing if there is no data or it cannot be parsed
+std::unique_ptr<TCorrContext> IIQFile::phase_one_prepare_corr(const std::vector<uint8_t>& calData,
+                                                              bool applyDefects)
+{
+    if (calData.empty())
+        return nullptr;
+
+    try
+    {
+        const auto start = TCorrClock::now();
+        auto ctx = std::make_unique<TCorrContext>(calData);
+        phase_one_parse_corr(*ctx, applyDefects);
+        ctx->parseTime = nsSince(start)/1e6;
+        return ctx;
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+// Subtracts black into the corrected raw buffer and applies parsed
+// corrections if any. This together with the parsing above is
+// essentially a copy of LibRaw phase_one_correct but without defects
+// fixing. Returns true if the raw was corrected.
+bool IIQFile::phase_one_correct(const TCorrContext* ctx, bool applyDefects)
+{
+    const auto start = TCorrClock::now();
+    corrStats_.clear();
+    if (ctx)
+        corrStats_.time[TCorrStats::CS_PARSE] = ctx->parseTime;
+
+    try
+    {
+        // corrected raw goes to own buffer reused between corrections
+        if (imgdata.rawdata.raw_image &&
+            imgdata.rawdata.raw_alloc != imgdata.rawdata.raw_image &&
+            (corrRaw_.empty() || imgdata.rawdata.raw_image != corrRaw_.data()))
+            phase_one_free_tempbuffer();
+        corrRaw_.resize(size_t(imgdata.sizes.raw_width)*imgdata.sizes.raw_height);
+        imgdata.rawdata.raw_image = corrRaw_.data();
+
+        // black set by user is left to LibRaw, otherwise black is
+        // subtracted with the other corrections
+        const bool userBlack = phase_one_user_black();
+        int rc = 0;
+        if (userBlack)
+        {
+            rc = phase_one_subtract_black((ushort *)imgdata.rawdata.raw_alloc,
+                                          imgdata.rawdata.raw_image);
+            corrStats_.time[TCorrStats::CS_BLACK] = nsSince(start)/1e6;
+            corrStats_.bytes[TCorrStats::CS_BLACK] =
+                uint64_t(imgdata.sizes.raw_width)*imgdata.sizes.raw_height*2*sizeof(uint16_t);
+        }
+        if (rc == 0)
+        {
+            try
+            {
+                static const TCorrPlan noCorr;
+                phase_one_apply_corr(ctx ? ctx->plan : noCorr, applyDefects, !userBlack);
+            }
+            catch (...)
+            {
+                rc = LIBRAW_CANCELLED_BY_CALLBACK;
+            }
+        }
+        corrStats_.time[TCorrStats::CS_TOTAL] = nsSince(start)/1e6 + corrStats_.time[TCorrStats::CS_PARSE];
+        for (int i = 0; i < TCorrStats::CS_TOTAL; ++i)
+            corrStats_.bytes[TCorrStats::CS_TOTAL] += corrStats_.bytes[i];
+        return rc == 0;
+    }
+    catch (const std::bad_alloc&)
+    {
+        imgdata.rawdata.raw_image = (ushort *)imgdata.rawdata.raw_alloc;
+        recycle();
+    }
+    catch (const LibRaw_exceptions& err)
+    {
+        imgdata.rawdata.raw_image = (ushort *)imgdata.rawdata.raw_alloc;
+        recycle();
+    }
+    return false;
+}
+
+// Calibration data to use - unsaved defect changes need rebuilding it
+static const std::vector<uint8_t>& corrCalData(const IIQCalFile& calFile, bool sensorPlus,
+                                               bool applyDefects, std::vector<uint8_t>& data)
+{
+    if (applyDefects && calFile.hasUnsavedChanges())
+    {
+        calFile.saveToData(data, sensorPlus);
+        return data;
+    }
+    return calFile.getCalFileData(sensorPlus);
+}
+
+// Applies corrections
+void IIQFile::applyPhaseOneCorr(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects)
+{
+    if (!is_phaseone_compressed() || !imgdata.rawdata.raw_alloc)
+        return;
+
+    std::vector<uint8_t> data;
+    const auto& calData = corrCalData(calFile, sensorPlus, applyDefects, data);
+    auto ctx = phase_one_prepare_corr(calData, applyDefects);
+    phase_one_correct(ctx.get(), applyDefects);
+}
+
+// Region decode keeps bands of this many rows, at most REGION_CACHE_BANDS
+// of them. Defects in the area are fixed from REGION_DEFECT_MARGIN rows
+// and columns around it.
+#define REGION_BAND_ROWS      64
+#define REGION_CACHE_BANDS    16
+#define REGION_DEFECT_MARGIN  8
+
+// Band of rows decoded for region decode, corrected apart from defects
+struct TRegionBand
+{
+    unsigned colEnd = 0;            // columns decoded, none if failed
+    uint64_t used = 0;              // last request it was needed by
+    std::vector<uint16_t> pixels;
+};
+
+// Region decode state - row offsets, black levels and parsed corrections
+// along with the bands decoded so far
+struct TRegionDecode
+{
+    TCorrPlan plan;
+    bool applyDefects = false;
+    std::vector<uint32_t> offset;
+    std::vector<int16_t> colBlack;
+    std::map<unsigned, TRegionBand> bands;
+    uint64_t requests = 0;
+};
+
+bool IIQFile::beginRegionDecode(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects)
+{
+    endRegionDecode();
+    if (!is_phaseone_compressed() || !ifp || imgdata.rawdata.raw_alloc ||
+        load_raw != &IIQFile::phase_one_load_raw_c || ph1.format == 6 ||
+        phase_one_user_black())
+        return false;
+
+    try
+    {
+        region_ = std::make_unique<TRegionDecode>();
+        phase_one_read_strips(region_->offset);
+        imgdata.rawdata.color.phase_one_data = ph1;
+        region_->colBlack = phase_one_col_black();
+
+        std::vector<uint8_t> data;
+        const auto& calData = corrCalData(calFile, sensorPlus, applyDefects, data);
+        if (auto ctx = phase_one_prepare_corr(calData, applyDefects))
+        {
+            region_->plan = std::move(ctx->plan);
+            region_->applyDefects = applyDefects;
+        }
+    }
+    catch (...)
+    {
+        endRegionDecode();
+        return false;
+    }
+    return true;
+}
+
+void IIQFile::endRegionDecode()
+{
+    if (!region_)
+        return;
+
+    // black data read for the region would be read again by unpack
+    free(imgdata.rawdata.ph1_cblack);
+    free(imgdata.rawdata.ph1_rblack);
+    imgdata.rawdata.ph1_cblack = nullptr;
+    imgdata.rawdata.ph1_rblack = nullptr;
+    region_.reset();
+}
+
+// Decodes columns up to colEnd of the bands and corrects them apart from
+// defects. Compressed data of the bands is read in turn through the own
+// stream and the bands are then decoded in parallel. Returns false if a
+// row depends on code lengths of the previous row that are not known.
+bool IIQFile::decodeRegionBands(const std::vector<unsigned>& bands, unsigned colEnd)
+{
+    const unsigned rawWidth = imgdata.sizes.raw_width;
+    const unsigned rawHeight = imgdata.sizes.raw_height;
+    const bool convEndian = order != 0x4949;
+    auto& region = *region_;
+
+    std::vector<std::vector<uint8_t>> data(bands.size());
+    std::vector<size_t> dataStart(bands.size());
+    std::vector<TRegionBand*> decoded(bands.size());
+    for (size_t i = 0; i < bands.size(); ++i)
+    {
+        checkCancel();
+        const unsigned rowStart = bands[i]*REGION_BAND_ROWS;
+        phase_one_read_band(region.offset, rowStart, std::min(rowStart + REGION_BAND_ROWS, rawHeight),
+                            data[i], dataStart[i]);
+        decoded[i] = &region.bands[bands[i]];
+        decoded[i]->colEnd = 0;
+    }
+
+    std::atomic<bool> failed(false);
+    tbb::parallel_for(size_t(0), bands.size(), [&](size_t i)
+    {
+        const unsigned rowStart = bands[i]*REGION_BAND_ROWS;
+        const unsigned rowEnd = std::min(rowStart + REGION_BAND_ROWS, rawHeight);
+        auto& band = *decoded[i];
+        band.pixels.assign(size_t(rowEnd - rowStart)*rawWidth, 0);
+        for (unsigned row = rowStart; row < rowEnd; ++row)
+        {
+            uint16_t* dest = band.pixels.data() + size_t(row - rowStart)*rawWidth;
+            int len[2] = { 0, 0 };
+            bool error = false;
+            TPh1Bits bits(data[i], region.offset[row] - dataStart[i], convEndian);
+            if (!decodePh1Row(bits, dest, rawWidth, colEnd, ph1.format, imgdata.color.curve, len, error))
+                continue;
+
+            // lengths left by the previous row are only known when rows
+            // end with a part block as those always use 14 bits
+            if (!(rawWidth & 7))
+            {
+                failed = true;
+                return;
+            }
+            TPh1Bits again(data[i], region.offset[row] - dataStart[i], convEndian);
+            len[0] = len[1] = 14;
+            decodePh1Row(again, dest, rawWidth, colEnd, ph1.format, imgdata.color.curve, len, error);
+        }
+
+        phase_one_black_rows(band.pixels.data(), band.pixels.data(), region.colBlack.data(),
+                             rowStart, rowEnd);
+        for (const auto& stage: region.plan.stages)
+            phase_one_apply_stage(stage, band.pixels.data(), rowStart, rowEnd);
+        band.colEnd = colEnd;
+    });
+
+    return !failed;
+}
+
+bool IIQFile::decodeRegion(const TRawRect& area, std::vector<uint16_t>& pixels)
+{
+    const int rawWidth = imgdata.sizes.raw_width;
+    const int rawHeight = imgdata.sizes.raw_height;
+    if (!region_ || area.empty() || area.col < 0 || area.row < 0 ||
+        area.col + area.width > rawWidth || area.row + area.height > rawHeight)
+        return false;
+
+    auto& region = *region_;
+    const int margin = region.applyDefects ? REGION_DEFECT_MARGIN : 0;
+    const unsigned rowStart = std::max(area.row - margin, 0);
+    const unsigned rowEnd = std::min(area.row + area.height + margin, rawHeight);
+    const unsigned colEnd = std::min(area.col + area.width + margin, rawWidth);
+
+    try
+    {
+        // bands not decoded yet or decoded for fewer columns
+        ++region.requests;
+        std::vector<unsigned> bands;
+        for (unsigned band = rowStart/REGION_BAND_ROWS; band <= (rowEnd - 1)/REGION_BAND_ROWS; ++band)
+        {
+            auto& cached = region.bands[band];
+            cached.used = region.requests;
+            if (cached.colEnd < colEnd)
+                bands.push_back(band);
+        }
+        if (!bands.empty() && !decodeRegionBands(bands, colEnd))
+            return false;
+
+        // least recently used bands over the limit go unless needed now
+        while (region.bands.size() > REGION_CACHE_BANDS)
+        {
+            auto lru = std::min_element(region.bands.begin(), region.bands.end(),
+                                        [](const auto& a, const auto& b) { return a.second.used < b.second.used; });
+            if (lru->second.used == region.requests)
+                break;
+            region.bands.erase(lru);
+        }
+
+        // rows around the area put together for fixing defects
+        const unsigned rows = rowEnd - rowStart;
+        std::vector<uint16_t> window(size_t(rows)*rawWidth);
+        for (unsigned row = rowStart; row < rowEnd; ++row)
+            std::memcpy(window.data() + size_t(row - rowStart)*rawWidth,
+                        region.bands[row/REGION_BAND_ROWS].pixels.data() + size_t(row % REGION_BAND_ROWS)*rawWidth,
+                        rawWidth*sizeof(uint16_t));
+
+        if (region.applyDefects)
+        {
+            // bad pixels with all their neighbours in the window, in the
+            // order of the full correction
+            const uint32_t base = rowStart*rawWidth;
+            const unsigned defStart = rowStart + (rowStart > 0 ? 2 : 0);
+            const unsigned defEnd = rowEnd - (rowEnd < unsigned(rawHeight) ? 2 : 0);
+            for (auto entry: region.plan.defectGather)
+            {
+                const unsigned row = entry.target/rawWidth;
+                if (row < defStart || row >= defEnd)
+                    continue;
+                entry.target -= base;
+                for (uint32_t k = 0; k < entry.count; ++k)
+                    entry.sources[k] -= base;
+                applyDefectGather(window.data(), entry);
+            }
+
+            // Bad column kernels address the raw so the window stands in
+            // for it. Columns are fixed in order and read already fixed
+            // ones on the left so those are fixed first.
+            if (!region.plan.badCols.empty())
+            {
+                const auto rawImage = imgdata.rawdata.raw_image;
+                imgdata.rawdata.raw_image = window.data();
+                imgdata.sizes.raw_height = rows;
+                phase_one_fix_bad_cols(region.plan.badCols, std::max(area.col - margin, 0),
+                                       area.col + area.width, 0, rows);
+                imgdata.rawdata.raw_image = rawImage;
+                imgdata.sizes.raw_height = rawHeight;
             }
         }
+
+        pixels.resize(size_t(area.width)*area.height);
+        for (int row = 0; row < area.height; ++row)
+            std::memcpy(pixels.data() + size_t(row)*area.width,
+                        window.data() + size_t(area.row + row - rowStart)*rawWidth + area.col,
+                        area.width*sizeof(uint16_t));
     }
     catch (...)
     {
-        return LIBRAW_CANCELLED_BY_CALLBACK;
+        return false;
     }
-    return 0;
+    return true;
 }
 
+size_t IIQFile::correctBatch(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects,
+                             const std::vector<IIQFile*>& files)
+{
+    std::vector<uint8_t> data;
+    const auto& calData = corrCalData(calFile, sensorPlus, applyDefects, data);
+
+    // Parsed corrections depend on the raw size, layout and the parameters
+    // used for polynomial curves so are shared by the frames where they match
+    using TCorrKey = std::tuple<unsigned, unsigned, unsigned, unsigned, unsigned, int, float>;
+    std::map<TCorrKey, std::unique_ptr<TCorrContext>> contexts;
+
+    using TFrame = std::pair<IIQFile*, const TCorrContext*>;
+    std::atomic<size_t> corrected = 0;
+    std::set<IIQFile*> picked;
+    size_t next = 0;
+
+    // Frames are picked and corrections parsed in order while picked
+    // frames are corrected in parallel with each of them also split
+    // into bands of rows in tiled mode
+    tbb::parallel_pipeline(BATCH_FRAMES_IN_FLIGHT,
+        tbb::make_filter<void, TFrame>(tbb::filter_mode::serial_in_order,
+        [&](tbb::flow_control& fc) -> TFrame
+        {
+            while (next < files.size())
+            {
+                IIQFile* file = files[next++];
+                if (!file || !file->is_phaseone_compressed() || !file->imgdata.rawdata.raw_alloc ||
+                    !picked.insert(file).second)
+                    continue;
+
+                TCorrKey key(file->imgdata.sizes.raw_width, file->imgdata.sizes.raw_height,
+                             file->imgdata.sizes.top_margin, file->imgdata.sizes.left_margin,
+                             file->imgdata.idata.filters,
+                             file->ph1.split_col, file->ph1.tag_210);
+                auto ctx = contexts.find(key);
+                if (ctx == contexts.end())
+                    ctx = contexts.emplace(key, file->phase_one_prepare_corr(calData, applyDefects)).first;
+
+                return TFrame(file, ctx->second.get());
+            }
+            fc.stop();
+            return TFrame(nullptr, nullptr);
+        }) &
+        tbb::make_filter<TFrame, void>(tbb::filter_mode::parallel,
+        [&](const TFrame& frame)
+        {
+            // black is still subtracted where calibration cannot be parsed
+            if (frame.first->phase_one_correct(frame.second, applyDefects) && frame.second)
+                ++corrected;
+        }));
+
+    return corrected;
+}
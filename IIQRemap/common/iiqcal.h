@@ -25,11 +25,34 @@
 
 #include <libraw.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
+// Rectangular area in raw (uncropped) coordinates
+struct TRawRect
+{
+    int col = 0;
+    int row = 0;
+    int width = 0;
+    int height = 0;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+};
+
+// Preview stored in standard TIFF strips of IIQ file
+struct TIIQThumbnail
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> rgb;   // 8 bit RGB, no row padding
+};
+
 // IIQ calibration file class
 class IIQCalFile
 {
@@ -128,6 +151,10 @@ public:
     // Access to raw file data
     const std::vector<uint8_t>& getCalFileData(bool sensorPlus) const { return calFileData_[sensorPlus]; };
 
+    // Hash of everything the raw correction depends on - equal hashes
+    // give the same corrected raw
+    uint64_t corrHash(bool sensorPlus, bool withDefects) const;
+
 private:
     // private functions
     void initCalData(const uint8_t* data, const size_t size);
@@ -146,24 +173,256 @@ private:
     bool hasSensorPlus_;
 };
 
+// Reads the preview from standard TIFF part of IIQ file without reading
+// the raw. Returns false if there is no uncompressed 8 bit RGB preview.
+bool readIIQThumbnail(const IIQCalFile::TFileNameType& fileName, TIIQThumbnail& thumbnail);
+
+// Timings and counters of the last Phase One correction by stage. In
+// tiled mode the stage times are summed over all the threads.
+struct TCorrStats
+{
+    enum EStage
+    {
+        CS_BLACK = 0,
+        CS_PARSE,
+        CS_CURVE,
+        CS_QUAD_LUT,
+        CS_QUAD_MULT,
+        CS_FLAT_FIELD,
+        CS_DEFECTS,
+        CS_TOTAL,
+        CS_COUNT
+    };
+
+    double time[CS_COUNT] = { 0 };      // milliseconds
+    uint64_t bytes[CS_COUNT] = { 0 };   // pixel data read and written
+    unsigned stages[CS_COUNT] = { 0 };  // applied stages of each kind
+    unsigned defPixels = 0;
+    unsigned defCols = 0;
+
+    void clear() { *this = TCorrStats(); }
+
+    static const char* stageName(EStage stage);
+
+    // multi line text dump
+    std::string toString() const;
+};
+
+struct TCorrStage;
+struct TCorrPlan;
+struct TCorrContext;
+struct TRegionDecode;
+
+// 2x2 CFA pattern with colours packed two bits each, row major
+#define CFA_PATTERN(c00, c01, c10, c11)  ((c00) | (c01)<<2 | (c10)<<4 | (c11)<<6)
+
+// CFA pattern known at compile time, colour of a pixel folds to
+// a constant in loops stepping over known row and column parity
+template <unsigned Pattern>
+struct TCFA
+{
+    static constexpr unsigned color(unsigned row, unsigned col)
+    { return (Pattern >> ((row&1)<<2 | (col&1)<<1)) & 3; }
+};
+
+// Any other CFA pattern looked up at run time
+struct TCFAAny
+{
+    unsigned pattern;
+
+    unsigned color(unsigned row, unsigned col) const
+    { return (pattern >> ((row&1)<<2 | (col&1)<<1)) & 3; }
+};
+
+// Calls f with the CFA object for the pattern. Four Bayer phases used
+// by Phase One backs are instantiated, anything else is run time.
+template <class F>
+inline void dispatchCFA(unsigned pattern, F&& f)
+{
+    switch (pattern)
+    {
+        case CFA_PATTERN(0,1,3,2): f(TCFA<CFA_PATTERN(0,1,3,2)>()); break;
+        case CFA_PATTERN(1,0,2,3): f(TCFA<CFA_PATTERN(1,0,2,3)>()); break;
+        case CFA_PATTERN(3,2,0,1): f(TCFA<CFA_PATTERN(3,2,0,1)>()); break;
+        case CFA_PATTERN(2,3,1,0): f(TCFA<CFA_PATTERN(2,3,1,0)>()); break;
+        default: f(TCFAAny{pattern}); break;
+    }
+}
+
+// Applies Phase One flat field to a single raw row of given width. The
+// head is the flat field header, mrow holds multipliers of even colours
+// for each of wide grid columns interpolated to this row. Colours come
+// from the CFA at cfaRow and columns shifted by leftMargin. Returns
+// number of pixels processed.
+template <class CFA>
+size_t flatFieldRow(uint16_t* pixel, unsigned width, const uint16_t* head,
+                    unsigned wide, unsigned nc, const float* mrow,
+                    unsigned cfaRow, unsigned leftMargin, CFA cfa)
+{
+    unsigned x, c, cend, col;
+    float mult[4];
+    size_t pixels = 0;
+
+    for (x = 1; x < wide; x++)
+    {
+        for (c = 0; c < nc; c += 2)
+        {
+            mult[c] = mrow[c * wide + x - 1];
+            mult[c + 1] = (mrow[c * wide + x] - mult[c]) / head[4];
+        }
+        cend = head[0] + x * head[4];
+        for (col = cend - head[4];
+             col < width && col < cend && col < unsigned(head[0] + head[2] - head[4]);
+             col++, pixels++)
+        {
+            c = nc > 2 ? cfa.color(cfaRow, col - leftMargin) : 0;
+            if (!(c & 1))
+            {
+                c = pixel[col] * mult[c];
+                pixel[col] = std::min(c, 65535u);
+            }
+            for (c = 0; c < nc; c += 2)
+                mult[c] += mult[c + 1];
+        }
+    }
+    return pixels;
+}
+
+// Fixed point version of the above - the multipliers ramp along the row
+// in Q24 integers and pixels are scaled with integer multiply. Products
+// of 16 bit pixels and multipliers above 1 need more than 32 bits so
+// they are 32x32 to 64 bit ones, Q16 with 32 bit products would
+// overflow. Results may differ from the float version by 1.
+#define FF_FRAC_BITS  24
+
+template <class CFA>
+size_t flatFieldRowFixed(uint16_t* pixel, unsigned width, const uint16_t* head,
+                         unsigned wide, unsigned nc, const float* mrow,
+                         unsigned cfaRow, unsigned leftMargin, CFA cfa)
+{
+    const unsigned colLimit = std::min(width, unsigned(head[0] + head[2] - head[4]));
+    const float scale = float(1 << FF_FRAC_BITS);
+    size_t pixels = 0;
+
+    // colour for even and odd columns, odd colours are not corrected
+    unsigned colour[2] = { 0, 0 };
+    if (nc > 2)
+        for (unsigned i = 0; i < 2; ++i)
+            colour[i] = cfa.color(cfaRow, i - leftMargin);
+
+    for (unsigned x = 1; x < wide; x++)
+    {
+        const unsigned cend = head[0] + x * head[4];
+        const unsigned colStart = cend - head[4];
+        const unsigned colEnd = std::min(cend, colLimit);
+        if (colStart >= colEnd)
+            continue;
+
+        int32_t mult[4], step[4];
+        for (unsigned c = 0; c < nc; c += 2)
+        {
+            const float start = mrow[c * wide + x - 1];
+            mult[c] = int32_t(std::lrint(start * scale));
+            step[c] = int32_t(std::lrint((mrow[c * wide + x] - start) / head[4] * scale));
+        }
+
+        if (nc == 2)
+        {
+            for (unsigned col = colStart; col < colEnd; col++)
+            {
+                const int64_t val = (int64_t(pixel[col]) * mult[0]) >> FF_FRAC_BITS;
+                pixel[col] = uint16_t(std::clamp(val, int64_t(0), int64_t(65535)));
+                mult[0] += step[0];
+            }
+        }
+        else
+        {
+            for (unsigned col = colStart; col < colEnd; col++)
+            {
+                const unsigned c = colour[col & 1];
+                if (!(c & 1))
+                {
+                    const int64_t val = (int64_t(pixel[col]) * mult[c]) >> FF_FRAC_BITS;
+                    pixel[col] = uint16_t(std::clamp(val, int64_t(0), int64_t(65535)));
+                }
+                mult[0] += step[0];
+                mult[2] += step[2];
+            }
+        }
+        pixels += colEnd - colStart;
+    }
+    return pixels;
+}
+
 // IIQ raw file class
 class IIQFile: public LibRaw
 {
 public:
 
-    IIQFile(): LibRaw(), calData_(nullptr),
-                         calDataEnd_(nullptr),
-                         calDataCurPtr_(nullptr),
-                         convEndian_(false) {}
+    IIQFile();
     ~IIQFile();
 
     IIQCalFile getIIQCalFile();
 
     bool isSensorPlus();
 
-    // Applies Phase One corrections
+    // Unpacks raw data, Phase One compressed raw is decoded natively
+    // with rows decoded in parallel
+    int unpack();
+
+    // Applies Phase One corrections. All the correction state is per
+    // call so different objects can be corrected concurrently.
     void applyPhaseOneCorr(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects);
 
+    // Applies Phase One corrections from the same calibration to many
+    // frames. Corrections are parsed once for all matching frames and
+    // frames are corrected in parallel, repeated frames only once.
+    // Returns number of frames corrected with the calibration, frames it
+    // cannot be parsed for only get black subtracted and are not counted.
+    static size_t correctBatch(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects,
+                               const std::vector<IIQFile*>& files);
+
+    // Re-applies defect corrections only around a single edited defect
+    // (negative row means the whole column) starting from pre-defect
+    // data kept by the last full correction. Returns the changed area
+    // which is empty if the full correction is needed instead.
+    TRawRect applyDefectCorrLocal(const IIQCalFile& calFile, bool sensorPlus, int col, int row);
+
+    // Region decode - decodes and corrects only the rows around an area
+    // of the raw straight after open_file, without unpack(). Rows are
+    // decoded in bands kept for the next areas. Meant for an IIQFile of
+    // its own opened on the file so it reads through its own stream while
+    // another one unpacks the file. Returns false if the raw cannot be
+    // decoded this way.
+    bool beginRegionDecode(const IIQCalFile& calFile, bool sensorPlus, bool applyDefects);
+    void endRegionDecode();
+
+    // Corrected pixels of the area in raw coordinates row by row. Defects
+    // are fixed from the rows around the area only, so results may differ
+    // slightly from the full correction where defects reach further.
+    bool decodeRegion(const TRawRect& area, std::vector<uint16_t>& pixels);
+
+    // Whether full corrections keep the values defect fixing overwrites
+    // for applyDefectCorrLocal(). Only worth it for the raw being
+    // edited, the values are dropped when unset (default).
+    void setKeepPreDefect(bool keep);
+
+    // Corrections are applied in cache sized bands of rows in parallel
+    // when tiled (default), otherwise one correction at a time to the
+    // whole raw. Zero cache size uses the default.
+    void setTiledCorrection(bool tiled, size_t cacheSize = 0)
+        { tiledCorr_ = tiled; corrCacheSize_ = cacheSize; }
+
+    // Flat fields are applied with fixed point integer arithmetic
+    // when set, otherwise in float as in LibRaw. Objects created later
+    // start with the default given (float unless set).
+    void setFixedPointFlatField(bool fixedPoint) { fixedFlatField_ = fixedPoint; }
+    static void setDefaultFixedPointFlatField(bool fixedPoint) { defaultFixedFlatField_ = fixedPoint; }
+    static bool defaultFixedPointFlatField() { return defaultFixedFlatField_; }
+
+    // Stats of the last applyPhaseOneCorr
+    const TCorrStats& getCorrStats() const { return corrStats_; }
+
     const std::string getPhaseOneSerial()
     {
         return is_phaseone_compressed() ? imgdata.shootinginfo.BodySerial : "";
@@ -180,33 +439,77 @@ public:
     uint16_t RAW(uint16_t row, uint16_t col) const
     { return imgdata.rawdata.raw_image[row*imgdata.sizes.raw_width + col]; }
 
+    // CFA pattern of the visible area for dispatchCFA()
+    unsigned cfaPattern()
+    { return CFA_PATTERN(FC(0,0), FC(0,1), FC(1,0), FC(1,1)); }
+
     bool isPhaseOne() { return is_phaseone_compressed(); }
 
     void closeFileStream();
 
+    // Approximate memory held by raw data and its corrected copies
+    size_t memoryUsed() const;
+
+protected:
+    // native decoder used by unpack() in place of LibRaw one
+    void phase_one_load_raw_parallel();
+
 private:
     // moved from LibRaw internal ones
+    void phase_one_read_strips(std::vector<uint32_t>& offset);
+    void phase_one_read_band(const std::vector<uint32_t>& offset,
+                             unsigned rowStart, unsigned rowEnd,
+                             std::vector<uint8_t>& data, size_t& dataStart);
     int p1rawc(unsigned row, unsigned col, unsigned& count) const;
     int p1raw(unsigned row, unsigned col) const;
+    void phase_one_compile_defects(TCorrPlan& plan,
+                                   const std::vector<std::pair<unsigned,unsigned>>& badPixels);
     void phase_one_fix_col_pixel_avg(unsigned row, unsigned col);
+    void phase_one_fix_col_pixel_avg_inner(unsigned row, unsigned col);
     void phase_one_fix_pixel_grad(unsigned row, unsigned col);
-    void phase_one_flat_field(int is_float, int nc);
-    int phase_one_correct(bool applyDefects = true);
+    void phase_one_fix_pixel_grad_inner(unsigned row, unsigned col);
+    void phase_one_fix_bad_cols(const std::vector<unsigned>& badCols,
+                                unsigned colStart, unsigned colEnd,
+                                unsigned rowStart, unsigned rowEnd);
+    bool phase_one_parse_flat_field(TCorrContext& ctx, TCorrStage& stage, int is_float, int nc);
+    size_t phase_one_flat_field(const TCorrStage& stage, uint16_t* raw,
+                                unsigned rowStart, unsigned rowEnd);
+    size_t phase_one_apply_stage(const TCorrStage& stage, uint16_t* raw,
+                                 unsigned rowStart, unsigned rowEnd);
+    void phase_one_parse_corr(TCorrContext& ctx, bool applyDefects);
+    bool phase_one_user_black() const;
+    std::vector<int16_t> phase_one_col_black() const;
+    void phase_one_black_rows(const uint16_t* src, uint16_t* dest, const int16_t* colBlack,
+                              unsigned rowStart, unsigned rowEnd);
+    void phase_one_apply_corr(const TCorrPlan& plan, bool applyDefects, bool subtractBlack);
+    std::unique_ptr<TCorrContext> phase_one_prepare_corr(const std::vector<uint8_t>& calData,
+                                                         bool applyDefects);
+    bool phase_one_correct(const TCorrContext* ctx, bool applyDefects);
+    bool decodeRegionBands(const std::vector<unsigned>& bands, unsigned colEnd);
     void readCalData();
-
-    uint32_t dataGetPos() { return calDataCurPtr_-calData_; }
-    void dataSetPos(uint32_t pos, bool fromCur = false);
-    void getShorts(uint16_t *shorts, uint32_t count);
-    uint16_t get16();
-    uint32_t get32();
-    float getFloat();
+    void clearPreDefect();
+    void keepPreDefectCol(unsigned col);
 
     // members
-    const uint8_t* calData_;
-    const uint8_t* calDataEnd_;
-    const uint8_t* calDataCurPtr_;
-    bool convEndian_;
     std::vector<uint8_t> calFileData_;
+    bool tiledCorr_;
+    size_t corrCacheSize_;
+    bool fixedFlatField_;
+    static bool defaultFixedFlatField_;
+    bool keepPreDefect_;
+    TCorrStats corrStats_;
+
+    // corrected raw
+    std::vector<uint16_t> corrRaw_;
+
+    // values defect fixing has overwritten since the last full correction -
+    // bad pixels by offset and whole bad columns
+    std::map<uint32_t, uint16_t> preDefectPixels_;
+    std::map<unsigned, std::vector<uint16_t>> preDefectCols_;
+    bool preDefectKept_;
+
+    // region decode state while decoding regions
+    std::unique_ptr<TRegionDecode> region_;
 };
 
 #endif
@@ -24,12 +24,15 @@
 
 #include "raw_image.h"
 
+#include <QFontDatabase>
 #include <QPainter>
 #include <QPaintEvent>
 
 #include <string.h>
 #include <math.h>
 
+#include <algorithm>
+
 #include <tbb/tbb.h>
 
 // --------------------------------------------------------
@@ -42,6 +45,17 @@ uint8_t from12To8[TOTAL_RAW_VALUES];
 //    helper functions
 // --------------------------------------------------------
 #define SQR(x) ((x)*(x))
+
+// Number of intervals the tone curve is sampled at, values in between
+// are interpolated linearly which keeps the curve monotone. Gamma is
+// too steep near black for that so the first intervals are calculated.
+#define TONE_KNOTS        4096
+#define TONE_EXACT_KNOTS  4
+
+// Lowest opacity of a defect density cell when zoomed out, it grows
+// up to full as the cell fills with defects
+#define DEF_DENSITY_MIN_ALPHA  96
+
 // gamma 2.2 lower region calculation variables
 static double g[5] = {1.0/2.2, 0, 0, 0, 0};
 static double bnd[2] = {0,0};
@@ -101,51 +115,34 @@ inline double f_CC(double x, double s, double V, double xA, double yA)
     return pow((1-s)*x + s*xA*pow(x/xA,V), log(yA)/log(xA));
 }
 
-// Adjustments calculation for a single point -
-// applies black level, gamma, exposure, contrast
-inline uint16_t adjustSinglePoint(uint16_t value,
-                                  uint16_t blackLevel,
-                                  double exposure,
-                                  double contrast,
-                                  double midpoint,
-                                  bool applyGamma,
-                                  bool blackLevelsZeroed)
+// Contrast and gamma of a point on [0..1] scale shared by all channels
+inline double adjustTone(double val,
+                         double contrast,
+                         double midpoint,
+                         bool applyGamma)
 {
     const double s = 0.5;  // larger - more contrast slope
 
-    if (value<=blackLevel)
-        return 0;
-
-    double val = blackLevelsZeroed
-                                ? double(value)/MAX_RAW_VALUE
-                                : double(value-blackLevel)/MAX_RAW_VALUE;
-
-    if (val<1)
-    {
-		val *= exposure;
-        if (val>1)
-            val = 1;
-        if (val < midpoint)
-            val = f_CC(val,s,contrast,midpoint,midpoint);
-        else
-            val = 1- f_CC(1-val,s,contrast,1-midpoint,1-midpoint);
-
-		if (applyGamma)
-            val = val < g[3]
-                        ? val*g[1]
-                        : (g[0]
-                            ? pow(val,g[0])*(1+g[4])-g[4]
-                            : log(val)*g[2]+1);
-    }
+    if (val < midpoint)
+        val = f_CC(val,s,contrast,midpoint,midpoint);
     else
-        val = 1;
+        val = 1- f_CC(1-val,s,contrast,1-midpoint,1-midpoint);
 
-    return uint16_t(MAX_RAW_VALUE * val);
+    if (applyGamma)
+        val = val < g[3]
+                    ? val*g[1]
+                    : (g[0]
+                        ? pow(val,g[0])*(1+g[4])-g[4]
+                        : log(val)*g[2]+1);
+
+    return val;
 }
 
+template <class CFA>
 inline void extractChannel(EChannel ch,
                            uint16_t *chValues,
                            IIQFile& raw,
+                           CFA cfa,
                            uint16_t row,
                            uint16_t col,
                            uint16_t blockSize)
@@ -154,10 +151,474 @@ inline void extractChannel(EChannel ch,
     uint16_t lastCol = col+blockSize;
     for (uint16_t rw=row; rw<lastRow; ++rw)
         for (uint16_t cl=col; cl<lastCol; ++cl)
-            if (raw.FC(rw, cl) == ch)
+            if (cfa.color(rw, cl) == unsigned(ch))
                 *chValues++ = raw.getRAW(rw, cl);
 }
 
+// --------------------------------------------------------
+//    RawCurves class
+// --------------------------------------------------------
+RawCurves::RawCurves()
+    : luts_(size_t(C_ALL+1)*TOTAL_RAW_VALUES, 0),
+      toneCurve_(TONE_KNOTS+1),
+      valid_(false)
+{
+    initStaticData();
+}
+
+void RawCurves::generate(const TRenderParams& params)
+{
+    const auto& prev = params_;
+    bool allChanged = !valid_ ||
+                      params.contrast != prev.contrast ||
+                      params.contrMidpoint != prev.contrMidpoint ||
+                      params.applyGamma != prev.applyGamma ||
+                      params.blackLevelsZeroed != prev.blackLevelsZeroed;
+
+    double contrast = params.contrast*10+1;
+    double exposure[C_ALL];
+    std::vector<int> channels;
+    for (int ch=C_RED; ch<C_ALL; ++ch)
+    {
+        exposure[ch] = params.exposure[C_ALL]*params.exposure[ch];
+        if (allChanged ||
+            exposure[ch] != prev.exposure[C_ALL]*prev.exposure[ch] ||
+            params.blckLevels[ch] != prev.blckLevels[ch] ||
+            params.chnlEnabled[ch] != prev.chnlEnabled[ch])
+            channels.push_back(ch);
+    }
+
+    // tone curve does not depend on the channel and is only sampled,
+    // black level and exposure stretch the raw onto it
+    if (!valid_ ||
+        params.contrast != prev.contrast ||
+        params.contrMidpoint != prev.contrMidpoint ||
+        params.applyGamma != prev.applyGamma)
+        for (int k=0; k<=TONE_KNOTS; ++k)
+            toneCurve_[k] = float(MAX_RAW_VALUE*adjustTone(double(k)/TONE_KNOTS,
+                                                           contrast,
+                                                           params.contrMidpoint,
+                                                           params.applyGamma));
+
+    if (!channels.empty())
+        tbb::parallel_for(tbb::blocked_range<int>(0, TOTAL_RAW_VALUES, 4096),
+        [&](const tbb::blocked_range<int>& values)
+        {
+            for (int ch: channels)
+            {
+                uint8_t* lut = luts_.data() + size_t(ch)*TOTAL_RAW_VALUES;
+                if (!params.chnlEnabled[ch])
+                {
+                    memset(lut + values.begin(), 0, values.size());
+                    continue;
+                }
+
+                const int blackLevel = params.blckLevels[ch];
+                const float scale = float(exposure[ch]*TONE_KNOTS/MAX_RAW_VALUE);
+                for (int i=values.begin(); i<values.end(); ++i)
+                {
+                    if (i<=blackLevel)
+                    {
+                        lut[i] = 0;
+                        continue;
+                    }
+
+                    int value = params.blackLevelsZeroed ? i : i-blackLevel;
+                    if (value>=MAX_RAW_VALUE)
+                    {
+                        lut[i] = from12To8[MAX_RAW_VALUE];
+                        continue;
+                    }
+
+                    float pos = std::min(value*scale, float(TONE_KNOTS));
+                    int k = std::min(int(pos), TONE_KNOTS-1);
+                    float val = k < TONE_EXACT_KNOTS
+                                    ? float(MAX_RAW_VALUE*adjustTone(double(pos)/TONE_KNOTS,
+                                                                     contrast,
+                                                                     params.contrMidpoint,
+                                                                     params.applyGamma))
+                                    : toneCurve_[k] + (pos-k)*(toneCurve_[k+1]-toneCurve_[k]);
+                    lut[i] = from12To8[uint16_t(val)];
+                }
+            }
+        });
+
+    params_ = params;
+    valid_ = true;
+}
+
+// Offsets of channels in 2x2 CFA blocks starting at even visible row
+// and column, the same for all such blocks
+static void blockOffsets(IIQFile& iiqFile, size_t rowStride, size_t offset[C_ALL])
+{
+    for (int pos=0; pos<4; ++pos)
+        offset[iiqFile.FC(pos>>1, pos&1)] = (pos>>1)*rowStride + (pos&1);
+}
+
+inline QRgb blockColour(const uint16_t* block, const size_t offset[C_ALL],
+                        const RawCurves& curves, bool gray)
+{
+    int r = curves.lut(C_RED)[block[offset[C_RED]]];
+    int g = (curves.lut(C_GREEN)[block[offset[C_GREEN]]] +
+             curves.lut(C_GREEN2)[block[offset[C_GREEN2]]] + 1) >> 1;
+    int b = curves.lut(C_BLUE)[block[offset[C_BLUE]]];
+    if (gray)
+        r = g = b = (r + 2*g + b + 2) >> 2;
+    return qRgb(r, g, b);
+}
+
+QImage renderSuperpixels(IIQFile& iiqFile, const RawCurves& curves)
+{
+    const int width = iiqFile.imgdata.sizes.width/2;
+    const int height = iiqFile.imgdata.sizes.height/2;
+    const int rawWidth = iiqFile.imgdata.sizes.raw_width;
+    const uint16_t* raw = iiqFile.imgdata.rawdata.raw_image +
+                          iiqFile.imgdata.sizes.top_margin*rawWidth +
+                          iiqFile.imgdata.sizes.left_margin;
+    const bool gray = curves.params().renderingType == R_COMPOSITE_GRAY;
+
+    size_t offset[C_ALL] = { 0, 0, 0, 0 };
+    blockOffsets(iiqFile, rawWidth, offset);
+
+    QImage image(width, height, QImage::Format_RGB32);
+    tbb::parallel_for(0, height, [&](int row)
+    {
+        const uint16_t* block = raw + size_t(row)*2*rawWidth;
+        QRgb* pixel = reinterpret_cast<QRgb*>(image.scanLine(row));
+        for (int col=0; col<width; ++col, block+=2)
+            pixel[col] = blockColour(block, offset, curves, gray);
+    });
+
+    return image;
+}
+
+QImage renderRawArea(IIQFile& iiqFile, const std::vector<uint16_t>& pixels,
+                     int width, int height, const RawCurves& curves)
+{
+    const bool gray = curves.params().renderingType == R_COMPOSITE_GRAY;
+
+    size_t offset[C_ALL] = { 0, 0, 0, 0 };
+    blockOffsets(iiqFile, width, offset);
+
+    QImage image(width, height, QImage::Format_RGB32);
+    tbb::parallel_for(0, height/2, [&](int row)
+    {
+        const uint16_t* block = pixels.data() + size_t(row)*2*width;
+        QRgb* pixel0 = reinterpret_cast<QRgb*>(image.scanLine(2*row));
+        QRgb* pixel1 = reinterpret_cast<QRgb*>(image.scanLine(2*row+1));
+        for (int col=0; col<width; col+=2, block+=2)
+            pixel0[col] = pixel0[col+1] = pixel1[col] = pixel1[col+1] =
+                blockColour(block, offset, curves, gray);
+    });
+
+    return image;
+}
+
+// --------------------------------------------------------
+//    RawRenderer class
+// --------------------------------------------------------
+RawRenderer::RawRenderer(QObject* parent)
+    : QThread(parent),
+      hasPending_(false),
+      busy_(false),
+      quit_(false),
+      request_(0)
+{
+}
+
+RawRenderer::~RawRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+        ++request_;
+    }
+    requestCond_.notify_all();
+    wait();
+}
+
+void RawRenderer::render(IIQFile* iiqFile, const TRenderParams& params,
+                         std::vector<TRenderTile>&& tiles)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.iiqFile = iiqFile;
+    pending_.params = params;
+    pending_.tiles = std::move(tiles);
+    hasPending_ = true;
+    ++request_;
+    requestCond_.notify_one();
+
+    if (!isRunning())
+        start();
+}
+
+void RawRenderer::stop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_ = TRequest();
+    hasPending_ = false;
+    ++request_;
+    idleCond_.wait(lock, [this] { return !busy_; });
+}
+
+void RawRenderer::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        requestCond_.wait(lock, [this] { return quit_ || hasPending_; });
+        if (quit_)
+            break;
+
+        TRequest request = std::move(pending_);
+        pending_ = TRequest();
+        hasPending_ = false;
+        busy_ = true;
+        uint32_t id = request_;
+
+        lock.unlock();
+        renderRequest(request, id);
+        lock.lock();
+
+        busy_ = false;
+        idleCond_.notify_all();
+    }
+}
+
+void RawRenderer::renderRequest(TRequest& request, uint32_t id)
+{
+    curves_.generate(request.params);
+
+    // batches of tiles keep them in order of request using all threads
+    const size_t count = request.tiles.size();
+    const size_t batch = std::max(1, tbb::this_task_arena::max_concurrency());
+    dispatchCFA(request.iiqFile->cfaPattern(), [&](auto cfa)
+    {
+        for (size_t first=0; first<count && !abandoned(id); first+=batch)
+        {
+            tbb::parallel_for(first, std::min(count, first+batch),
+            [&](size_t i)
+            {
+                if (abandoned(id))
+                    return;
+
+                const auto& tile = request.tiles[i];
+                QImage image(tile.rect.width() >> tile.level, tile.rect.height() >> tile.level,
+                             QImage::Format_RGB32);
+                if (tile.level == 0)
+                    renderTile(*request.iiqFile, request.params, tile.rect, image, cfa);
+                else
+                    renderReducedTile(*request.iiqFile, request.params, tile.rect,
+                                      tile.level, image, cfa);
+
+                if (!abandoned(id))
+                    Q_EMIT tileRendered(tile.tile, tile.version, image);
+            });
+        }
+    });
+}
+
+// Renders the tile - CFA pattern is taken once per tile as it repeats
+// every 2x2 block
+template <class CFA>
+void RawRenderer::renderTile(IIQFile& iiqFile, const TRenderParams& params,
+                             const QRect& rect, QImage& image, CFA cfa)
+{
+    const int width = iiqFile.imgdata.sizes.width;
+    const int height = iiqFile.imgdata.sizes.height;
+    const int rawWidth = iiqFile.imgdata.sizes.raw_width;
+    const uint16_t* raw = iiqFile.imgdata.rawdata.raw_image +
+                          iiqFile.imgdata.sizes.top_margin*rawWidth +
+                          iiqFile.imgdata.sizes.left_margin;
+
+    // tiles are aligned to 2x2 blocks apart from the odd last row or column
+    int firstRow = rect.top();
+    int lastRow = rect.bottom()+1;
+    int firstCol = rect.left();
+    int lastCol = rect.right()+1;
+
+    auto lut = [this](int ch) { return curves_.lut(ch); };
+    auto outPixel = [&](int row, int col)
+    {
+        return reinterpret_cast<QRgb*>(image.scanLine(row-rect.top())) + col-rect.left();
+    };
+
+    if (params.renderingType == R_RGB)
+    {
+        // each colour comes from the last of its pixels in the block,
+        // missing one from the zero table
+        const size_t offset[4] = { 0, 1, size_t(rawWidth), size_t(rawWidth)+1 };
+        auto blockSetup = [&](int row, int col, const uint8_t* luts[3], size_t offs[3])
+        {
+            for (int ch=C_RED; ch<=C_BLUE; ++ch)
+            {
+                luts[ch] = lut(C_ALL);
+                offs[ch] = 0;
+                for (int pos=0; pos<4; ++pos)
+                    if (int(cfa.color(row + (pos>>1), col + (pos&1))) == ch)
+                    {
+                        luts[ch] = lut(ch);
+                        offs[ch] = offset[pos];
+                    }
+            }
+        };
+
+        for (int row=firstRow; row<lastRow; row+=2)
+        {
+            if (row + 1 == height)
+                --row;
+
+            const uint8_t* luts[3];
+            size_t offs[3];
+            blockSetup(row, firstCol, luts, offs);
+
+            const uint16_t* src = raw + size_t(row)*rawWidth;
+            for (int col=firstCol; col<lastCol; col+=2)
+            {
+                if (col + 1 == width)
+                {
+                    --col;
+                    blockSetup(row, col, luts, offs);
+                }
+
+                const uint16_t* block = src + col;
+                QRgb pixel = qRgb(luts[C_RED][block[offs[C_RED]]],
+                                  luts[C_GREEN][block[offs[C_GREEN]]],
+                                  luts[C_BLUE][block[offs[C_BLUE]]]);
+
+                QRgb* row0 = outPixel(row, col);
+                QRgb* row1 = outPixel(row+1, col);
+
+                row0[0]=row0[1]=row1[0]=row1[1]=pixel;
+            }
+        }
+    }
+    else if (params.renderingType == R_COMPOSITE_COLOUR)
+    {
+        static const int shift[C_ALL] = { 16, 8, 0, 8 };
+        for (int row=firstRow; row<lastRow; ++row)
+        {
+            const uint16_t* src = raw + size_t(row)*rawWidth;
+            QRgb* pixel = outPixel(row, firstCol);
+            for (int col=firstCol; col<lastCol; ++col, ++pixel)
+            {
+                int channel = cfa.color(row, col);
+                *pixel = 0xFF000000u | QRgb(lut(channel)[src[col]]) << shift[channel];
+            }
+        }
+    }
+    else if (params.renderingType == R_COMPOSITE_GRAY)
+    {
+        for (int row=firstRow; row<lastRow; ++row)
+        {
+            const uint16_t* src = raw + size_t(row)*rawWidth;
+            const uint8_t* rowLut[2] = { lut(cfa.color(row, 0)), lut(cfa.color(row, 1)) };
+            QRgb* pixel = outPixel(row, firstCol);
+            for (int col=firstCol; col<lastCol; ++col, ++pixel)
+            {
+                uint8_t val = rowLut[col&1][src[col]];
+                *pixel = qRgb(val, val, val);
+            }
+        }
+    }
+}
+
+// Renders the area reduced by 2^level straight from the raw, each pixel
+// is the average of the full size rendering over its cell. Cells are
+// aligned to 2x2 blocks, incomplete ones at the end are left out.
+template <class CFA>
+void RawRenderer::renderReducedTile(IIQFile& iiqFile, const TRenderParams& params,
+                                    const QRect& rect, int level, QImage& image, CFA cfa)
+{
+    const int rawWidth = iiqFile.imgdata.sizes.raw_width;
+    const uint16_t* raw = iiqFile.imgdata.rawdata.raw_image +
+                          iiqFile.imgdata.sizes.top_margin*rawWidth +
+                          iiqFile.imgdata.sizes.left_margin;
+
+    const int cell = 1 << level;
+    const int shift = 2*level;
+    const uint32_t round = 1u << (shift-1);
+    const int outWidth = image.width();
+    const int cols = outWidth*cell;
+
+    auto lut = [this](int ch) { return curves_.lut(ch); };
+
+    // red, green and blue sums of every output pixel
+    std::vector<uint32_t> sum(outWidth*3);
+
+    // full size RGB rendering repeats each colour of the block 4 times
+    // taking it from the last of its pixels there
+    const uint8_t* luts[3];
+    size_t offs[3] = { 0, 0, 0 };
+    if (params.renderingType == R_RGB)
+    {
+        const size_t offset[4] = { 0, 1, size_t(rawWidth), size_t(rawWidth)+1 };
+        for (int ch=C_RED; ch<=C_BLUE; ++ch)
+        {
+            luts[ch] = lut(C_ALL);
+            for (int pos=0; pos<4; ++pos)
+                if (int(cfa.color(rect.top() + (pos>>1), rect.left() + (pos&1))) == ch)
+                {
+                    luts[ch] = lut(ch);
+                    offs[ch] = offset[pos];
+                }
+        }
+    }
+
+    // composite colour shows green2 as green
+    static const int component[C_ALL] = { C_RED, C_GREEN, C_BLUE, C_GREEN };
+
+    for (int outRow=0; outRow<image.height(); ++outRow)
+    {
+        std::fill(sum.begin(), sum.end(), 0);
+        int firstRow = rect.top() + outRow*cell;
+
+        if (params.renderingType == R_RGB)
+        {
+            for (int row=firstRow; row<firstRow+cell; row+=2)
+            {
+                const uint16_t* block = raw + size_t(row)*rawWidth + rect.left();
+                for (int col=0; col<cols; col+=2, block+=2)
+                {
+                    uint32_t* out = &sum[(col >> level)*3];
+                    for (int ch=C_RED; ch<=C_BLUE; ++ch)
+                        out[ch] += uint32_t(luts[ch][block[offs[ch]]]) << 2;
+                }
+            }
+        }
+        else if (params.renderingType == R_COMPOSITE_COLOUR)
+        {
+            for (int row=firstRow; row<firstRow+cell; ++row)
+            {
+                const uint16_t* src = raw + size_t(row)*rawWidth + rect.left();
+                for (int col=0; col<cols; ++col)
+                {
+                    int channel = cfa.color(row, rect.left() + col);
+                    sum[(col >> level)*3 + component[channel]] += lut(channel)[src[col]];
+                }
+            }
+        }
+        else if (params.renderingType == R_COMPOSITE_GRAY)
+        {
+            for (int row=firstRow; row<firstRow+cell; ++row)
+            {
+                const uint16_t* src = raw + size_t(row)*rawWidth + rect.left();
+                const uint8_t* rowLut[2] = { lut(cfa.color(row, 0)), lut(cfa.color(row, 1)) };
+                for (int col=0; col<cols; ++col)
+                    sum[(col >> level)*3] += rowLut[col&1][src[col]];
+            }
+            for (int col=0; col<outWidth; ++col)
+                sum[col*3+C_GREEN] = sum[col*3+C_BLUE] = sum[col*3];
+        }
+
+        QRgb* pixel = reinterpret_cast<QRgb*>(image.scanLine(outRow));
+        for (int col=0; col<outWidth; ++col)
+            pixel[col] = qRgb((sum[col*3+C_RED] + round) >> shift,
+                              (sum[col*3+C_GREEN] + round) >> shift,
+                              (sum[col*3+C_BLUE] + round) >> shift);
+    }
+}
+
 // --------------------------------------------------------
 //    IIQRawImage class
 // --------------------------------------------------------
@@ -166,17 +627,34 @@ IIQRawImage::IIQRawImage(QWidget *parent)
       enableCols_(true), enablePoints_(true),
       defPointsCount_(0), defColsCount_(0),
       applyDefectCorr_(false),
+      showCorrStats_(false),
       curDefSetMode_(M_NONE),
 	  width_(0), height_(0), topMargin_(0), leftMargin_(0),
       curSensorPlus_(false),
+      corrHash_{0, 0},
       scale_(1), pX(0), pY(0),
-      pauseUpdates_(false), rawData8_(0),
+      pauseUpdates_(false),
+      tileCacheUsed_(0), tileCacheBudget_(size_t(DISPLAY_CACHE_MB)<<20),
+      renderVersion_(0),
+      renderer_(0),
+      requestedLevel_(-1),
+      previewPending_(false), previewScale_(1),
       renderingType_(R_RGB), applyGamma_(true),
       blackLevelsZeroed_(true),
       contrast_(0),
       contrMidpoint_(0.5)
 {
     initStaticData();
+
+    renderer_ = new RawRenderer(this);
+    connect(renderer_, SIGNAL(tileRendered(quint64,quint32,QImage)),
+            this, SLOT(tileRendered(quint64,quint32,QImage)));
+
+    // changes made together are rendered once
+    renderRequest_.setSingleShot(true);
+    renderRequest_.setInterval(0);
+    connect(&renderRequest_, SIGNAL(timeout()), this, SLOT(requestRender()));
+
     chnlEnabled[C_GREEN]  = true;
     chnlEnabled[C_RED]    = true;
     chnlEnabled[C_BLUE]   = true;
@@ -190,91 +668,24 @@ IIQRawImage::IIQRawImage(QWidget *parent)
 
 IIQRawImage::~IIQRawImage()
 {
-    delete[] rawData8_;
-    rawData8_ = 0;
-}
-
-void IIQRawImage::generateCurves(EChannel channel)
-{
-    if (channel == C_ALL)
-    {
-        double contrast = contrast_*10+1;
-        double exposure[4];
-        exposure[C_RED]    = exposure_[C_ALL]*exposure_[C_RED];
-        exposure[C_GREEN]  = exposure_[C_ALL]*exposure_[C_GREEN];
-        exposure[C_BLUE]   = exposure_[C_ALL]*exposure_[C_BLUE];
-        exposure[C_GREEN2] = exposure_[C_ALL]*exposure_[C_GREEN2];
-
-        tbb::parallel_for(size_t(0), size_t(TOTAL_RAW_VALUES),
-        [&](size_t i)
-        {
-            chnlCurves_[C_RED][i] = adjustSinglePoint(
-                                             i,
-                                             blckLevels_[C_RED],
-                                             exposure[C_RED],
-                                             contrast,
-                                             contrMidpoint_,
-                                             applyGamma_,
-                                             blackLevelsZeroed_);
-            chnlCurves_[C_GREEN][i] = adjustSinglePoint(
-                                             i,
-                                             blckLevels_[C_GREEN],
-                                             exposure[C_GREEN],
-                                             contrast,
-                                             contrMidpoint_,
-                                             applyGamma_,
-                                             blackLevelsZeroed_);
-            chnlCurves_[C_BLUE][i] = adjustSinglePoint(
-                                             i,
-                                             blckLevels_[C_BLUE],
-                                             exposure[C_BLUE],
-                                             contrast,
-                                             contrMidpoint_,
-                                             applyGamma_,
-                                             blackLevelsZeroed_);
-            chnlCurves_[C_GREEN2][i] = adjustSinglePoint(
-                                             i,
-                                             blckLevels_[C_GREEN2],
-                                             exposure[C_GREEN2],
-                                             contrast,
-                                             contrMidpoint_,
-                                             applyGamma_,
-                                             blackLevelsZeroed_);
-        });
-    }
-    else
-    {
-        uint16_t *chCurve = chnlCurves_[channel];
-        double contrast = contrast_*10+1;
-        double exposure = exposure_[C_ALL]*exposure_[channel];
-
-        tbb::parallel_for(size_t(0), size_t(TOTAL_RAW_VALUES),
-        [&](size_t i)
-        {
-            chCurve[i] = adjustSinglePoint(i,
-                                           blckLevels_[channel],
-                                           exposure,
-                                           contrast,
-                                           contrMidpoint_,
-                                           applyGamma_,
-                                           blackLevelsZeroed_);
-        });
-    }
+    stopRendering();
 }
 
 QSize IIQRawImage::sizeHint() const
 {
+    if (previewShown())
+        return QSize(previewSize_.width()*scale_, previewSize_.height()*scale_);
+
     return QSize(width_*scale_, height_*scale_);
 }
 
 void IIQRawImage::paintEvent(QPaintEvent *p)
 {
-    if (!iiqFile_[curSensorPlus_] && !calFile_.valid(curSensorPlus_))
+    if (!iiqFile_[curSensorPlus_] && !calFile_.valid(curSensorPlus_) && !previewShown())
         QLabel::paintEvent(p);
     else
     {
         QPainter painter(this);
-        QPen pen(defColour_);
 
         // set this hint otherwise scaling down raw with only
         // a few channels selected does not work properly
@@ -295,25 +706,221 @@ void IIQRawImage::paintEvent(QPaintEvent *p)
         // the adjust is to account for half points along edges
         exposedRect = painter.worldTransform().inverted().mapRect(exposedRect).adjusted(-1, -1, 1, 1);
         imageRect   = painter.worldTransform().inverted().mapRect(imageRect).adjusted(-1, -1, 1, 1);
+        QPoint offset = exposedRect.topLeft() - imageRect.topLeft();
+
+        // raw being loaded is shown from its preview and the area
+        // decoded so far
+        if (previewShown())
+        {
+            painter.drawImage(QRect(QPoint(0, 0), previewSize_).translated(offset),
+                              preview_, preview_.rect());
+            if (!region_.isNull())
+                painter.drawImage(regionArea_.translated(offset), region_, region_.rect());
+            return;
+        }
+
+        // parts of the raw not rendered yet are filled from its preview
+        auto drawPreview = [&](const QRect& area)
+        {
+            double sx = double(preview_.width())/width_;
+            double sy = double(preview_.height())/height_;
+            painter.drawImage(QRectF(area.translated(offset)), preview_,
+                              QRectF(area.x()*sx, area.y()*sy, area.width()*sx, area.height()*sy));
+        };
 
         if (iiqFile_[curSensorPlus_])
-            painter.drawPixmap(exposedRect, rawPixmap_, imageRect);
+        {
+            // tiles are painted straight from rendered images of the level
+            // matching the zoom, missing ones are filled from a coarser
+            // level already rendered or from the preview
+            int level = mipLevel();
+            QRect view = imageRect.intersected(QRect(0, 0, width_, height_));
+            QSize count = tileCount(level);
+            int span = RENDER_TILE_SIZE << level;
+            int lastTileX = std::min(view.right()/span, count.width()-1);
+            int lastTileY = std::min(view.bottom()/span, count.height()-1);
+            for (int ty=std::min(view.top()/span, count.height()-1); !view.isEmpty() && ty<=lastTileY; ++ty)
+                for (int tx=std::min(view.left()/span, count.width()-1); tx<=lastTileX; ++tx)
+                {
+                    quint64 tile = tileAt(level, tx, ty);
+                    QRect area = tileRect(tile).intersected(view);
+                    if (drawTile(painter, tile, area, offset))
+                        continue;
+
+                    bool drawn = false;
+                    for (int l=level+1; l<=MIP_LEVELS && !drawn; ++l)
+                    {
+                        QSize lCount = tileCount(l);
+                        int lSpan = RENDER_TILE_SIZE << l;
+                        drawn = drawTile(painter, tileAt(l, std::min(area.left()/lSpan, lCount.width()-1),
+                                                         std::min(area.top()/lSpan, lCount.height()-1)),
+                                         area, offset);
+                    }
+
+                    if (drawn)
+                        continue;
+                    else if (preview_.isNull())
+                        painter.fillRect(area.translated(offset), Qt::black);
+                    else
+                        drawPreview(area);
+                }
+
+            // request is renewed once view moves or zoom changes level
+            if (!pauseUpdates_ && (level != requestedLevel_ || !requestedView_.contains(viewRect())))
+                renderRequest_.start();
+        }
 
         if (calFile_.valid(curSensorPlus_))
         {
-            painter.setPen(pen);
-            if (iiqFile_[curSensorPlus_])
-                painter.setBackgroundMode(Qt::TransparentMode);
-            else
-            {
-                painter.setBackgroundMode(Qt::OpaqueMode);
-                QBrush bgrBrush(Qt::black);
-                painter.setBackground(bgrBrush);
+            if (!iiqFile_[curSensorPlus_])
+                painter.fillRect(imageRect.intersected(QRect(0, 0, width_, height_)).translated(offset),
+                                 Qt::black);
+            drawDefects(painter, imageRect, offset);
+        }
+
+        if (showCorrStats_ && iiqFile_[curSensorPlus_])
+            drawCorrStats(painter);
+
+        previewInset_ = QRect();
+        if (previewPending_ && iiqFile_[curSensorPlus_] && !preview_.isNull())
+            drawPreviewInset(painter);
+
+        regionInset_ = QRect();
+        if (iiqFile_[curSensorPlus_] && !region_.isNull())
+            drawRegionInset(painter);
+    }
+}
+
+// Draws defects in the visible part of the raw. Points are merged into
+// spans along rows, when zoomed out their density is shown instead.
+void IIQRawImage::drawDefects(QPainter& painter, const QRect& imageRect, const QPoint& offset)
+{
+    QRect view = imageRect.intersected(QRect(0, 0, width_, height_));
+    if (view.isEmpty() || (int)defRows_.size() != height_)
+        return;
 
+    painter.save();
+    painter.translate(offset.x(), offset.y());
+
+    auto firstCol = std::lower_bound(defCols_.begin(), defCols_.end(), view.left());
+    auto lastCol = std::upper_bound(firstCol, defCols_.end(), view.right());
+
+    if (int level = mipLevel())
+    {
+        // defects per cell of about a screen pixel
+        int cell = 1 << level;
+        QRect grid(view.left()/cell, view.top()/cell,
+                   view.right()/cell - view.left()/cell + 1,
+                   view.bottom()/cell - view.top()/cell + 1);
+        std::vector<int> counts(size_t(grid.width())*grid.height(), 0);
+        for (int row=view.top(); row<=view.bottom(); ++row)
+        {
+            const auto& cols = defRows_[row];
+            int* cellRow = counts.data() + size_t(row/cell - grid.top())*grid.width();
+            for (auto it=std::lower_bound(cols.begin(), cols.end(), view.left());
+                 it!=cols.end() && *it<=view.right(); ++it)
+                ++cellRow[*it/cell - grid.left()];
+        }
+
+        QImage density(grid.width(), grid.height(), QImage::Format_ARGB32_Premultiplied);
+        density.fill(Qt::transparent);
+        const int full = cell*cell;
+        for (int y=0; y<grid.height(); ++y)
+        {
+            QRgb* pixel = reinterpret_cast<QRgb*>(density.scanLine(y));
+            const int* count = counts.data() + size_t(y)*grid.width();
+            for (int x=0; x<grid.width(); ++x)
+                if (count[x])
+                {
+                    int alpha = DEF_DENSITY_MIN_ALPHA +
+                                (255-DEF_DENSITY_MIN_ALPHA)*std::min(count[x], full)/full;
+                    pixel[x] = qPremultiply(qRgba(defColour_.red(), defColour_.green(),
+                                                  defColour_.blue(), alpha));
+                }
+        }
+        painter.drawImage(QRect(grid.left()*cell, grid.top()*cell,
+                                grid.width()*cell, grid.height()*cell),
+                          density, QRect(0, 0, grid.width(), grid.height()));
+
+        // columns stay a screen pixel wide
+        std::vector<QLine> lines;
+        for (auto it=firstCol; it!=lastCol; ++it)
+            lines.emplace_back(*it, view.top(), *it, view.bottom());
+        QPen pen(defColour_);
+        pen.setCosmetic(true);
+        painter.setPen(pen);
+        painter.drawLines(lines.data(), (int)lines.size());
+    }
+    else
+    {
+        std::vector<QRect> rects;
+        for (int row=view.top(); row<=view.bottom(); ++row)
+        {
+            const auto& cols = defRows_[row];
+            auto it = std::lower_bound(cols.begin(), cols.end(), view.left());
+            while (it!=cols.end() && *it<=view.right())
+            {
+                // adjacent defects make a single span
+                int start = *it++;
+                int end = start;
+                while (it!=cols.end() && *it==end+1)
+                    end = *it++;
+                rects.emplace_back(start, row, end-start+1, 1);
             }
-            painter.drawPixmap(exposedRect, defBitmap_, imageRect);
         }
+        for (auto it=firstCol; it!=lastCol; ++it)
+            rects.emplace_back(*it, view.top(), 1, view.height());
+
+        painter.setPen(Qt::NoPen);
+        painter.setBrush(defColour_);
+        painter.drawRects(rects.data(), (int)rects.size());
     }
+
+    painter.restore();
+}
+
+// Debug overlay with last correction timings
+void IIQRawImage::drawCorrStats(QPainter& painter)
+{
+    const QString text = QString::fromStdString(
+                            iiqFile_[curSensorPlus_]->getCorrStats().toString());
+    const QRect visible = visibleRegion().boundingRect().adjusted(8, 8, -8, -8);
+
+    painter.resetTransform();
+    painter.setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    QRect textRect = painter.boundingRect(visible, Qt::AlignLeft|Qt::AlignTop, text);
+    painter.fillRect(textRect.adjusted(-4, -4, 4, 4), QColor(0, 0, 0, 160));
+    painter.setPen(Qt::white);
+    painter.drawText(textRect, Qt::AlignLeft|Qt::AlignTop, text);
+}
+
+// Preview of the raw being loaded over the top right corner of the
+// visible area, the shown raw stays in view
+void IIQRawImage::drawPreviewInset(QPainter& painter)
+{
+    const QRect visible = visibleRegion().boundingRect().adjusted(8, 8, -8, -8);
+    QSize size = preview_.size().scaled(PREVIEW_INSET_SIZE, PREVIEW_INSET_SIZE, Qt::KeepAspectRatio);
+    previewInset_ = QRect(QPoint(visible.right()-size.width()+1, visible.top()), size);
+
+    painter.resetTransform();
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    painter.fillRect(previewInset_.adjusted(-4, -4, 4, 4), QColor(0, 0, 0, 160));
+    painter.drawImage(previewInset_, preview_);
+    painter.setPen(Qt::white);
+    painter.drawText(previewInset_.adjusted(4, 4, -4, -4), Qt::AlignLeft|Qt::AlignTop, tr("Loading"));
+}
+
+// Area of the raw being loaded at 1:1 over the top right corner of the
+// visible area below its preview
+void IIQRawImage::drawRegionInset(QPainter& painter)
+{
+    const QRect visible = visibleRegion().boundingRect().adjusted(8, 8, -8, -8);
+    const int top = previewInset_.isNull() ? visible.top() : previewInset_.bottom()+13;
+    regionInset_ = QRect(QPoint(visible.right()-region_.width()+1, top), region_.size());
+
+    painter.resetTransform();
+    painter.fillRect(regionInset_.adjusted(-4, -4, 4, 4), QColor(0, 0, 0, 160));
+    painter.drawImage(regionInset_, region_);
 }
 
 void IIQRawImage::resizeEvent(QResizeEvent *event)
@@ -326,7 +933,7 @@ void IIQRawImage::resizeEvent(QResizeEvent *event)
 
 void IIQRawImage::mouseMoveEvent(QMouseEvent *e)
 {
-    if (iiqFile_[curSensorPlus_])
+    if (iiqFile_[curSensorPlus_] && !previewShown())
     {
         uint16_t col = uint16_t(double(e->position().rx()-pX)/scale_);
         uint16_t row = uint16_t(double(e->position().ry()-pY)/scale_);
@@ -338,7 +945,9 @@ void IIQRawImage::mouseMoveEvent(QMouseEvent *e)
 
 void IIQRawImage::mousePressEvent(QMouseEvent *e)
 {
-    if (calFile_.valid(curSensorPlus_) && curDefSetMode_ != M_NONE)
+    if (calFile_.valid(curSensorPlus_) && curDefSetMode_ != M_NONE && !previewShown() &&
+        !previewInset_.contains(e->position().toPoint()) &&
+        !regionInset_.contains(e->position().toPoint()))
     {
         uint16_t col = uint16_t(double(e->position().rx()-pX)/scale_);
         uint16_t row = uint16_t(double(e->position().ry()-pY)/scale_);
@@ -366,12 +975,32 @@ void IIQRawImage::mousePressEvent(QMouseEvent *e)
 
         if (updated)
         {
-            updateDefects();
+            if (applyDefectCorr_ && iiqFile_[curSensorPlus_])
+                updateDefectCorr(col, curDefSetMode_==M_COL ? -1 : row);
+
+            updateDefect(col, curDefSetMode_==M_COL ? -1 : row);
             Q_EMIT defectsChanged();
         }
     }
 }
 
+// re-applies defect corrections after single defect edit (negative
+// row for columns) re-rendering only the changed area if possible
+void IIQRawImage::updateDefectCorr(int col, int row)
+{
+    auto& iiqFile = iiqFile_[curSensorPlus_];
+    stopRendering();
+    TRawRect area = iiqFile->applyDefectCorrLocal(calFile_, curSensorPlus_, col, row);
+
+    if (area.empty())
+    {
+        iiqFile->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
+        updateRaw();
+    }
+    else
+        updateRaw(QRect(area.col-leftMargin_, area.row-topMargin_, area.width, area.height));
+}
+
 void IIQRawImage::setScale(double scale)
 {
     if (scale)
@@ -404,7 +1033,6 @@ void IIQRawImage::setRawRenderingType(ERawRendering renderingType)
     {
         renderingType_ = renderingType;
         updateRaw();
-        repaint();
     }
 }
 
@@ -413,9 +1041,7 @@ void IIQRawImage::enableGammaCorrection(bool enable)
     if (applyGamma_ != enable)
     {
         applyGamma_ = enable;
-        generateCurves();
         updateRaw();
-        repaint();
     }
 }
 
@@ -424,9 +1050,7 @@ void IIQRawImage::enableBlackLevelZeroed(bool enable)
     if (blackLevelsZeroed_ != enable)
     {
         blackLevelsZeroed_ = enable;
-        generateCurves();
         updateRaw();
-        repaint();
     }
 }
 
@@ -445,35 +1069,27 @@ void IIQRawImage::resetAllCorrections()
     contrast_ = 0;
     contrMidpoint_ = 0.5;
 
-    generateCurves();
     updateRaw();
-    repaint();
 }
 
 // exposure corrections
 void IIQRawImage::setExpCorr(double expCorr, EChannel channel)
 {
     exposure_[channel] = expCorr;
-    generateCurves(channel);
     updateRaw();
-    repaint();
 }
 
 // contrast corrections
 void IIQRawImage::setContrCorr(double contrast)
 {
     contrast_ = contrast;
-    generateCurves();
     updateRaw();
-    repaint();
 }
 
 void IIQRawImage::setContrMidpoint(double ctrsMidpoint)
 {
     contrMidpoint_ = ctrsMidpoint;
-    generateCurves();
     updateRaw();
-    repaint();
 }
 
 void IIQRawImage::setBlack(int blackLevel, EChannel channel)
@@ -481,10 +1097,7 @@ void IIQRawImage::setBlack(int blackLevel, EChannel channel)
     if (blackLevel!=blckLevels_[channel] && blackLevel<TOTAL_RAW_VALUES)
     {
         blckLevels_[channel] = (uint16_t)blackLevel;
-
-        generateCurves(channel);
         updateRaw();
-        repaint();
     }
 }
 
@@ -495,9 +1108,7 @@ void IIQRawImage::setWB(double* wb)
     exposure_[C_BLUE] = wb[C_BLUE];
     exposure_[C_GREEN2] = wb[C_GREEN2];
 
-    generateCurves();
     updateRaw();
-    repaint();
 }
 
 // enable/disable channels
@@ -506,9 +1117,7 @@ void IIQRawImage::enableChannel(bool enable, EChannel channel)
     if (channel!=C_ALL)
     {
         chnlEnabled[channel] = enable;
-
         updateRaw();
-        repaint();
     }
 }
 
@@ -518,14 +1127,29 @@ void IIQRawImage::pauseUpdates(bool pauseUpdates)
     if (!pauseUpdates_)
     {
         updateRaw();
-        repaint();
     }
 }
 
-void IIQRawImage::setSensorPlus(bool sensorPlus, double scale)
+uint64_t IIQRawImage::getCorrHash(bool sensorPlus)
 {
     if (!iiqFile_[sensorPlus])
-        return;
+        return 0;
+
+    // shown raw follows all calibration changes
+    return sensorPlus == curSensorPlus_ ? calFile_.corrHash(sensorPlus, applyDefectCorr_)
+                                        : corrHash_[sensorPlus];
+}
+
+bool IIQRawImage::setSensorPlus(bool sensorPlus, double scale, bool correct)
+{
+    if (!iiqFile_[sensorPlus])
+        return false;
+
+    stopRendering();
+
+    // remember what the raw being hidden is corrected with
+    if (sensorPlus != curSensorPlus_)
+        corrHash_[curSensorPlus_] = getCorrHash(curSensorPlus_);
 
     curSensorPlus_ = sensorPlus;
 
@@ -535,15 +1159,24 @@ void IIQRawImage::setSensorPlus(bool sensorPlus, double scale)
     height_ = iiqFile_[curSensorPlus_]->imgdata.sizes.height;
     topMargin_ = iiqFile_[curSensorPlus_]->imgdata.sizes.top_margin;
 
-    // setup bitmap
-    defBitmap_ = QBitmap(width_, height_);
-
-    iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
-
-    delete[] rawData8_;
-    rawData8_ = 0;
+    // only the shown raw keeps its state before defects for local refixing
+    iiqFile_[curSensorPlus_]->setKeepPreDefect(true);
+    if (iiqFile_[!curSensorPlus_])
+        iiqFile_[!curSensorPlus_]->setKeepPreDefect(false);
+
+    // preview of the raw being set fills in tiles until they are rendered
+    if (!previewPending_ || previewSize_ != QSize(width_, height_))
+        preview_ = QImage();
+    previewPending_ = false;
+    region_ = QImage();
+
+    // raw kept corrected with the same calibration is just swapped in
+    if (correct)
+        correct = corrHash_[curSensorPlus_] != calFile_.corrHash(curSensorPlus_, applyDefectCorr_);
+    if (correct)
+        iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
 
-    rawData8_ = new uint8_t[height_*width_*3];
+    resetTiles();
 
     // copy the raw data
     updateRaw();
@@ -557,13 +1190,24 @@ void IIQRawImage::setSensorPlus(bool sensorPlus, double scale)
     adjustSize();
     repaint();
 
+    return correct;
 }
 
-void IIQRawImage::setRawImage(std::unique_ptr<IIQFile>& iiqFile, double scale)
+bool IIQRawImage::setRawImage(std::unique_ptr<IIQFile>& iiqFile, double scale, uint64_t corrHash)
 {
     bool sensorPlus = iiqFile->isSensorPlus();
-    iiqFile_[sensorPlus] = std::move(iiqFile);
+    stopRendering();
+
+    // shown raw is switched to before calibration changes
+    if (sensorPlus != curSensorPlus_)
+        corrHash_[curSensorPlus_] = getCorrHash(curSensorPlus_);
+    curSensorPlus_ = sensorPlus;
+
+    std::swap(iiqFile_[sensorPlus], iiqFile);
     iiqFile_[sensorPlus]->closeFileStream(); // read all needed resources and release file handle
+    iiqFile_[sensorPlus]->setKeepPreDefect(true);
+    if (iiqFile)
+        iiqFile->setKeepPreDefect(false);
     if (!calFile_.valid() || calFile_.getCalSerial() != iiqFile_[sensorPlus]->getPhaseOneSerial())
     {
         calFile_ = iiqFile_[sensorPlus]->getIIQCalFile();
@@ -578,9 +1222,13 @@ void IIQRawImage::setRawImage(std::unique_ptr<IIQFile>& iiqFile, double scale)
         calFile_.merge(loadedCal);
     }
 
-    iiqFile_[sensorPlus]->applyPhaseOneCorr(calFile_, sensorPlus, applyDefectCorr_);
+    bool corrected = corrHash != 0 && corrHash == calFile_.corrHash(sensorPlus, applyDefectCorr_);
+    if (!corrected)
+        iiqFile_[sensorPlus]->applyPhaseOneCorr(calFile_, sensorPlus, applyDefectCorr_);
+
+    setSensorPlus(sensorPlus, scale, false);
 
-    setSensorPlus(sensorPlus, scale);
+    return corrected;
 }
 
 void IIQRawImage::setDefectCorr(bool applyDefectCorr)
@@ -588,31 +1236,101 @@ void IIQRawImage::setDefectCorr(bool applyDefectCorr)
     if (calFile_.valid(curSensorPlus_) && applyDefectCorr_ != applyDefectCorr)
     {
         applyDefectCorr_ = applyDefectCorr;
+        stopRendering();
         iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
         updateRaw();
         repaint();
     }
 }
 
+void IIQRawImage::showCorrStats(bool show)
+{
+    if (showCorrStats_ != show)
+    {
+        showCorrStats_ = show;
+        update();
+    }
+}
+
 void IIQRawImage::clearRawImage()
 {
     if (!iiqFile_[0] && !iiqFile_[1])
         return;
 
+    renderRequest_.stop();
+    stopRendering();
+
     width_ = 0;
     height_ = 0;
 
     iiqFile_[0] = std::unique_ptr<IIQFile>();
     if (iiqFile_[1])
         iiqFile_[1] = std::unique_ptr<IIQFile>();
+    corrHash_[0] = corrHash_[1] = 0;
+    tiles_.clear();
+    tileLru_.clear();
+    tileCacheUsed_ = 0;
+    tileVersion_.clear();
+    preview_ = QImage();
+    previewPending_ = false;
+    region_ = QImage();
     calFile_ = IIQCalFile();
-    delete[] rawData8_;
-    rawData8_ = 0;
+    defRows_.clear();
+    defCols_.clear();
     curSensorPlus_ = false;
 
     repaint();
 }
 
+void IIQRawImage::setPreview(const QImage& image, int width, int height, double scale)
+{
+    // current raw stays shown and editable with the preview drawn over
+    // its corner, the preview then fills in the loaded one until rendered
+    bool shown = previewShown();
+    preview_ = image;
+    previewSize_ = QSize(width, height);
+    previewPending_ = true;
+    if (iiqFile_[curSensorPlus_])
+    {
+        update();
+        return;
+    }
+
+    if (!shown)
+        previewScale_ = scale_;
+    if (scale != 0)
+        scale_ = scale;
+
+    adjustSize();
+    update();
+}
+
+void IIQRawImage::setRegionPreview(const QImage& image, const QRect& area)
+{
+    region_ = image;
+    regionArea_ = area;
+    update();
+}
+
+void IIQRawImage::setDisplayCacheSize(size_t size)
+{
+    tileCacheBudget_ = size;
+    evictTiles();
+}
+
+void IIQRawImage::clearPreview()
+{
+    if (previewShown())
+        scale_ = previewScale_;
+
+    preview_ = QImage();
+    previewPending_ = false;
+    region_ = QImage();
+
+    adjustSize();
+    update();
+}
+
 void IIQRawImage::setDefectColour(QColor &colour)
 {
     defColour_ = colour;
@@ -635,11 +1353,12 @@ bool IIQRawImage::setCalFile(IIQCalFile& calFile)
         calFile_.swap(calFile, calFile.valid(true));
 
     // update raw
+    stopRendering();
     iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
     updateRaw();
 
-    // update bitmap
-    updateDefectsBitmap();
+    // update defects
+    updateDefectIndex();
 
     // reset editing mode
     setDefectSettingMode(M_NONE);
@@ -656,46 +1375,81 @@ void IIQRawImage::discardChanges()
         return;
 
     calFile_.swap(iiqFile_[curSensorPlus_]->getIIQCalFile(), curSensorPlus_);
+    stopRendering();
     iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
 
     updateRaw();
     updateDefects();
 }
 
-void IIQRawImage::updateDefectsBitmap()
+// rebuilds the index of enabled defects
+void IIQRawImage::updateDefectIndex()
 {
     if (pauseUpdates_ || !calFile_.valid(curSensorPlus_))
         return;
 
     defPointsCount_ = 0;
     defColsCount_ = 0;
+    defRows_.assign(height_, std::vector<uint16_t>());
+    defCols_.clear();
 
-    // update bitmap
-    defBitmap_.clear();
-
-    QPainter painter(&defBitmap_);
-    QPen pen(Qt::color1);
-    painter.setPen(pen);
-
-    // paint point defects
+    // points are ordered by column so each row is filled sorted
     if (enablePoints_)
         for (auto [col, row] : calFile_.getDefectPixels(curSensorPlus_))
         {
             ++defPointsCount_;
-            if (row>=topMargin_ && col>=leftMargin_)
-                painter.drawPoint(col-leftMargin_, row-topMargin_);
+            if (row>=topMargin_ && row-topMargin_<height_ &&
+                col>=leftMargin_ && col-leftMargin_<width_)
+                defRows_[row-topMargin_].push_back(col-leftMargin_);
         }
 
-    // paint column defects
     if (enableCols_)
         for (auto col : calFile_.getDefectCols(curSensorPlus_))
         {
             ++defColsCount_;
-            if (col>=leftMargin_)
-                painter.drawLine(col-leftMargin_, 0, col-leftMargin_, height_);
+            if (col>=leftMargin_ && col-leftMargin_<width_)
+                defCols_.push_back(col-leftMargin_);
         }
 }
 
+// brings the index up to date after a single defect edit (negative
+// row for columns) and repaints just that defect
+void IIQRawImage::updateDefect(int col, int row)
+{
+    if (pauseUpdates_ || !calFile_.valid(curSensorPlus_) || (int)defRows_.size() != height_)
+    {
+        updateDefects();
+        return;
+    }
+
+    int x = col-leftMargin_;
+    int y = row-topMargin_;
+    if (x<0 || x>=width_ || (row>=0 && (y<0 || y>=height_)))
+    {
+        updateDefects();
+        return;
+    }
+
+    bool defect = row<0 ? calFile_.isDefCol(col, curSensorPlus_)
+                        : calFile_.isDefPixel(col, row, curSensorPlus_);
+    auto& cols = row<0 ? defCols_ : defRows_[y];
+    int& count = row<0 ? defColsCount_ : defPointsCount_;
+    auto it = std::lower_bound(cols.begin(), cols.end(), x);
+    bool indexed = it!=cols.end() && *it==x;
+    if (defect && !indexed)
+    {
+        cols.insert(it, uint16_t(x));
+        ++count;
+    }
+    else if (!defect && indexed)
+    {
+        cols.erase(it);
+        --count;
+    }
+
+    updateArea(row<0 ? QRect(x, 0, 1, height_) : QRect(x, y, 1, 1));
+}
+
 // attempts to autoremap points
 bool IIQRawImage::performAvgAutoRemap(double* avgValues, uint16_t* thresholds)
 {
@@ -703,23 +1457,28 @@ bool IIQRawImage::performAvgAutoRemap(double* avgValues, uint16_t* thresholds)
         return false;
 
     bool remapped = false;
-    for (uint16_t row=0; row<height_; ++row)
-        for (uint16_t col=0; col<width_; ++col)
-        {
-            EChannel channel = EChannel(iiqFile_[curSensorPlus_]->FC(row, col));
-            uint16_t threshold = thresholds[channel];
-            if (threshold>0 &&
-                fabs(avgValues[channel]-iiqFile_[curSensorPlus_]->getRAW(row,col))>threshold)
+    IIQFile& raw = *iiqFile_[curSensorPlus_];
+    dispatchCFA(raw.cfaPattern(), [&](auto cfa)
+    {
+        for (uint16_t row=0; row<height_; ++row)
+            for (uint16_t col=0; col<width_; ++col)
             {
-                if (calFile_.addDefPixel(col+leftMargin_, row+topMargin_, curSensorPlus_))
-                    remapped = true;
+                EChannel channel = EChannel(cfa.color(row, col));
+                uint16_t threshold = thresholds[channel];
+                if (threshold>0 &&
+                    fabs(avgValues[channel]-raw.getRAW(row,col))>threshold)
+                {
+                    if (calFile_.addDefPixel(col+leftMargin_, row+topMargin_, curSensorPlus_))
+                        remapped = true;
+                }
             }
-        }
+    });
 
     if (remapped)
     {
         if (applyDefectCorr_)
         {
+            stopRendering();
             iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
             updateRaw();
         }
@@ -755,63 +1514,68 @@ bool IIQRawImage::performAdaptiveAutoRemap(uint16_t* thresholds,
     // loop through blocks claculating median for all channels in a block and
     // then marking the defective pixels as those that exceed thresholds
     // against median
-    for (int y=0; y<height_; y+=blockSize)
+    IIQFile& raw = *iiqFile_[curSensorPlus_];
+    dispatchCFA(raw.cfaPattern(), [&](auto cfa)
     {
-        uint16_t row = uint16_t(y);
-        if (row+blockSize>height_)
-            row = height_-blockSize;
-        for (int x=0; x<width_; x+=blockSize)
+        for (int y=0; y<height_; y+=blockSize)
         {
-            uint16_t values[(MAX_ADAPTIVE_BLOCK*MAX_ADAPTIVE_BLOCK)/4];
-            uint16_t col = uint16_t(x);
-            if (col+blockSize>width_)
-                col = width_-blockSize;
-
-            if (ch == C_ALL)
+            uint16_t row = uint16_t(y);
+            if (row+blockSize>height_)
+                row = height_-blockSize;
+            for (int x=0; x<width_; x+=blockSize)
             {
-                median[C_RED]=median[C_GREEN]=median[C_BLUE]=median[C_GREEN2]=0;
-                extractChannel(C_RED, values, *iiqFile_[curSensorPlus_], row, col, blockSize);
-                median[C_RED] = calc_median(values, chBlockCount);
-                extractChannel(C_GREEN, values, *iiqFile_[curSensorPlus_], row, col, blockSize);
-                median[C_GREEN] = calc_median(values, chBlockCount);
-                extractChannel(C_BLUE, values, *iiqFile_[curSensorPlus_], row, col, blockSize);
-                median[C_BLUE] = calc_median(values, chBlockCount);
-                extractChannel(C_GREEN2, values, *iiqFile_[curSensorPlus_], row, col, blockSize);
-                median[C_GREEN2] = calc_median(values, chBlockCount);
-            }
-            else
-            {
-                median[ch]=0;
-                extractChannel(ch, values, *iiqFile_[curSensorPlus_], row, col, blockSize);
-                median[ch] = calc_median(values, chBlockCount);
-            }
+                uint16_t values[(MAX_ADAPTIVE_BLOCK*MAX_ADAPTIVE_BLOCK)/4];
+                uint16_t col = uint16_t(x);
+                if (col+blockSize>width_)
+                    col = width_-blockSize;
 
-            // walk the block and mark the defects
-            uint16_t lastRow = row+blockSize;
-            uint16_t lastCol = col+blockSize;
-            for (uint16_t rw=row; rw<lastRow; rw++)
-                for (uint16_t cl=col; cl<lastCol; cl++)
+                if (ch == C_ALL)
                 {
-                    EChannel channel = EChannel(iiqFile_[curSensorPlus_]->FC(rw, cl));
-                    if (ch != C_ALL && ch!=channel)
-                        continue;
+                    median[C_RED]=median[C_GREEN]=median[C_BLUE]=median[C_GREEN2]=0;
+                    extractChannel(C_RED, values, raw, cfa, row, col, blockSize);
+                    median[C_RED] = calc_median(values, chBlockCount);
+                    extractChannel(C_GREEN, values, raw, cfa, row, col, blockSize);
+                    median[C_GREEN] = calc_median(values, chBlockCount);
+                    extractChannel(C_BLUE, values, raw, cfa, row, col, blockSize);
+                    median[C_BLUE] = calc_median(values, chBlockCount);
+                    extractChannel(C_GREEN2, values, raw, cfa, row, col, blockSize);
+                    median[C_GREEN2] = calc_median(values, chBlockCount);
+                }
+                else
+                {
+                    median[ch]=0;
+                    extractChannel(ch, values, raw, cfa, row, col, blockSize);
+                    median[ch] = calc_median(values, chBlockCount);
+                }
 
-                    uint16_t threshold = thresholds[channel];
-                    if (threshold>0 && abs(median[channel]-iiqFile_[curSensorPlus_]->getRAW(rw, cl))>threshold)
+                // walk the block and mark the defects
+                uint16_t lastRow = row+blockSize;
+                uint16_t lastCol = col+blockSize;
+                for (uint16_t rw=row; rw<lastRow; rw++)
+                    for (uint16_t cl=col; cl<lastCol; cl++)
                     {
-                        if (countOnly)
-                            counts[channel]++;
-                        else if (calFile_.addDefPixel(cl+leftMargin_, rw+topMargin_, curSensorPlus_))
-                            remapped = true;
+                        EChannel channel = EChannel(cfa.color(rw, cl));
+                        if (ch != C_ALL && ch!=channel)
+                            continue;
+
+                        uint16_t threshold = thresholds[channel];
+                        if (threshold>0 && abs(median[channel]-raw.getRAW(rw, cl))>threshold)
+                        {
+                            if (countOnly)
+                                counts[channel]++;
+                            else if (calFile_.addDefPixel(cl+leftMargin_, rw+topMargin_, curSensorPlus_))
+                                remapped = true;
+                        }
                     }
-                }
+            }
         }
-    }
+    });
 
     if (remapped)
     {
         if (applyDefectCorr_)
         {
+            stopRendering();
             iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
             updateRaw();
         }
@@ -851,88 +1615,278 @@ void IIQRawImage::eraseEnabledDefects()
     if (enableCols_)
         calFile_.removeDefCol(-1, curSensorPlus_);
 
+    // shown raw follows the calibration, getCorrHash() relies on it
+    if (applyDefectCorr_ && iiqFile_[curSensorPlus_])
+    {
+        stopRendering();
+        iiqFile_[curSensorPlus_]->applyPhaseOneCorr(calFile_, curSensorPlus_, applyDefectCorr_);
+        updateRaw();
+    }
     updateDefects();
 }
 
-void IIQRawImage::updateRaw()
+// marks tiles in the area for rendering, whole raw if area is null
+void IIQRawImage::updateRaw(const QRect& area)
 {
-    if (pauseUpdates_ || !iiqFile_[curSensorPlus_] || !rawData8_)
+    if (pauseUpdates_ || !iiqFile_[curSensorPlus_] || tileVersion_.empty())
         return;
 
-    #define TO_8_BIT(val) from12To8[(val)]
+    QRect rect = area.isNull() ? QRect(0, 0, width_, height_)
+                               : area.intersected(QRect(0, 0, width_, height_));
+    if (rect.isEmpty())
+        return;
 
-    if (renderingType_ == R_RGB)
-    {
-        tbb::parallel_for(size_t(0), size_t((height_+1)>>1),
-        [&](size_t i)
-        {
-            int row = i<<1;
-            if (row + 1 == height_)
-                --row;
-            for (int col=0; col<width_; col+=2)
-            {
-                if (col + 1 == width_)
-                    --col;
+    uint32_t version = ++renderVersion_;
+    QSize count = tileCount(0);
+    int lastTileX = std::min(rect.right()/RENDER_TILE_SIZE, count.width()-1);
+    int lastTileY = std::min(rect.bottom()/RENDER_TILE_SIZE, count.height()-1);
+    for (int ty=std::min(rect.top()/RENDER_TILE_SIZE, count.height()-1); ty<=lastTileY; ++ty)
+        for (int tx=std::min(rect.left()/RENDER_TILE_SIZE, count.width()-1); tx<=lastTileX; ++tx)
+            tileVersion_[ty*count.width() + tx] = version;
+
+    renderRequest_.start();
+}
+
+// Requests rendering of tiles of the current level in view and then
+// of ones around it which are not cached or out of date
+void IIQRawImage::requestRender()
+{
+    if (pauseUpdates_ || !iiqFile_[curSensorPlus_] || tileVersion_.empty())
+        return;
 
-                uint16_t pixel[C_ALL] = { 0, 0, 0, 0 };
-                pixel[iiqFile_[curSensorPlus_]->FC(row, col)] =
-                    getRawDataEnabled(iiqFile_[curSensorPlus_]->FC(row, col),row,col);
-                pixel[iiqFile_[curSensorPlus_]->FC(row, col+1)] =
-                    getRawDataEnabled(iiqFile_[curSensorPlus_]->FC(row, col+1),row,col+1);
-                pixel[iiqFile_[curSensorPlus_]->FC(row+1, col)] =
-                    getRawDataEnabled(iiqFile_[curSensorPlus_]->FC(row+1, col),row+1,col);
-                pixel[iiqFile_[curSensorPlus_]->FC(row+1, col+1)] =
-                    getRawDataEnabled(iiqFile_[curSensorPlus_]->FC(row+1, col+1),row+1,col+1);
-
-                uint8_t* row0 = rawData8_ + (row*width_ + col)*3;
-                uint8_t* row1 = row0 + width_*3;
-
-                row0[0]=row0[3]=row1[0]=row1[3]=TO_8_BIT(pixel[C_RED]);
-                row0[1]=row0[4]=row1[1]=row1[4]=TO_8_BIT(((uint32_t)pixel[C_GREEN] + pixel[C_GREEN])>>1);
-                row0[2]=row0[5]=row1[2]=row1[5]=TO_8_BIT(pixel[C_BLUE]);
+    QRect view = viewRect();
+    int level = mipLevel();
+    QSize count = tileCount(level);
+    int span = RENDER_TILE_SIZE << level;
+    QRect around = view.adjusted(-span, -span, span, span).intersected(QRect(0, 0, width_, height_));
+
+    std::vector<TRenderTile> tiles;
+    int lastTileX = std::min(around.right()/span, count.width()-1);
+    int lastTileY = std::min(around.bottom()/span, count.height()-1);
+    for (bool visible: { true, false })
+        for (int ty=std::min(around.top()/span, count.height()-1); !around.isEmpty() && ty<=lastTileY; ++ty)
+            for (int tx=std::min(around.left()/span, count.width()-1); tx<=lastTileX; ++tx)
+            {
+                quint64 tile = tileAt(level, tx, ty);
+                QRect rect = tileRect(tile);
+                if (rect.intersects(view) != visible)
+                    continue;
+
+                uint32_t version = tileVersion(rect);
+                auto cached = tiles_.find(tile);
+                if (cached == tiles_.end() || cached->second.version != version)
+                    tiles.push_back({ tile, version, rect, level });
             }
-        });
+
+    // tiles in view are kept from now on
+    requestedView_ = view;
+    requestedLevel_ = level;
+    evictTiles();
+
+    renderer_->render(iiqFile_[curSensorPlus_].get(), renderParams(), std::move(tiles));
+}
+
+// Takes a rendered tile unless it has changed since requested
+void IIQRawImage::tileRendered(quint64 tile, quint32 version, const QImage& image)
+{
+    int level = int(tile >> 32);
+    if (tileVersion_.empty() || level > MIP_LEVELS)
+        return;
+
+    QSize count = tileCount(level);
+    if (int(tile & 0xFFFF) >= count.width() || int((tile >> 16) & 0xFFFF) >= count.height())
+        return;
+
+    QRect rect = tileRect(tile);
+    if (tileVersion(rect) != version)
+        return;
+
+    // implicitly shared image is kept and painted as is
+    putTile(tile, image, version);
+    if (!preview_.isNull() && viewRendered())
+        preview_ = QImage();
+
+    updateArea(rect);
+}
+
+// repaints the part of the widget showing the area of the raw
+void IIQRawImage::updateArea(const QRect& area)
+{
+    calcViewpointOffsets();
+    update(QRectF(area.x()*scale_ + pX, area.y()*scale_ + pY,
+                  area.width()*scale_, area.height()*scale_).toAlignedRect().adjusted(-1, -1, 1, 1));
+}
+
+// Visible part of the raw
+QRect IIQRawImage::viewRect()
+{
+    calcViewpointOffsets();
+    QRect visible = visibleRegion().boundingRect();
+
+    return QRectF((visible.x()-pX)/scale_, (visible.y()-pY)/scale_,
+                  visible.width()/scale_, visible.height()/scale_)
+                .toAlignedRect().intersected(QRect(0, 0, width_, height_));
+}
+
+TRenderParams IIQRawImage::renderParams() const
+{
+    TRenderParams params;
+    params.renderingType = renderingType_;
+    params.contrast = contrast_;
+    params.contrMidpoint = contrMidpoint_;
+    params.blackLevelsZeroed = blackLevelsZeroed_;
+    params.applyGamma = applyGamma_;
+    for (int ch=C_RED; ch<=C_ALL; ++ch)
+        params.exposure[ch] = exposure_[ch];
+    for (int ch=C_RED; ch<C_ALL; ++ch)
+    {
+        params.blckLevels[ch] = blckLevels_[ch];
+        params.chnlEnabled[ch] = chnlEnabled[ch];
+    }
+
+    return params;
+}
+
+// tiles layout for the current raw size, nothing is rendered yet
+void IIQRawImage::resetTiles()
+{
+    QSize count = tileCount(0);
+    tileVersion_.assign(count.width()*count.height(), ++renderVersion_);
+    tiles_.clear();
+    tileLru_.clear();
+    tileCacheUsed_ = 0;
+    requestedView_ = QRect();
+    requestedLevel_ = -1;
+}
+
+// number of tiles across and down the raw on the level
+QSize IIQRawImage::tileCount(int level) const
+{
+    int span = RENDER_TILE_SIZE << level;
+    return QSize(std::max(1, width_/span), std::max(1, height_/span));
+}
+
+quint64 IIQRawImage::tileAt(int level, int col, int row) const
+{
+    return quint64(level) << 32 | quint64(row) << 16 | quint64(col);
+}
+
+// area of the raw the tile covers
+QRect IIQRawImage::tileRect(quint64 tile) const
+{
+    int level = int(tile >> 32);
+    int tx = int(tile & 0xFFFF);
+    int ty = int((tile >> 16) & 0xFFFF);
+    QSize count = tileCount(level);
+    int span = RENDER_TILE_SIZE << level;
+    int col = tx*span;
+    int row = ty*span;
+
+    return QRect(col, row,
+                 tx == count.width()-1 ? width_-col : span,
+                 ty == count.height()-1 ? height_-row : span);
+}
+
+// latest version of the raw area, tiles of all levels are aligned to
+// full size ones
+uint32_t IIQRawImage::tileVersion(const QRect& rect) const
+{
+    QSize count = tileCount(0);
+    int lastTileX = std::min(rect.right()/RENDER_TILE_SIZE, count.width()-1);
+    int lastTileY = std::min(rect.bottom()/RENDER_TILE_SIZE, count.height()-1);
+    uint32_t version = 0;
+    for (int ty=std::min(rect.top()/RENDER_TILE_SIZE, count.height()-1); ty<=lastTileY; ++ty)
+        for (int tx=std::min(rect.left()/RENDER_TILE_SIZE, count.width()-1); tx<=lastTileX; ++tx)
+            version = std::max(version, tileVersion_[ty*count.width() + tx]);
+
+    return version;
+}
+
+// draws the area of the raw from the cached tile if there is one
+bool IIQRawImage::drawTile(QPainter& painter, quint64 tile, const QRect& area, const QPoint& offset)
+{
+    auto cached = tiles_.find(tile);
+    if (cached == tiles_.end())
+        return false;
+
+    double factor = 1 << int(tile >> 32);
+    QRect rect = tileRect(tile);
+    painter.drawImage(QRectF(area.translated(offset)), cached->second.image,
+                      QRectF((area.x()-rect.x())/factor, (area.y()-rect.y())/factor,
+                             area.width()/factor, area.height()/factor));
+
+    tileLru_.splice(tileLru_.begin(), tileLru_, cached->second.lru);
+
+    return true;
+}
+
+void IIQRawImage::putTile(quint64 tile, const QImage& image, uint32_t version)
+{
+    auto cached = tiles_.find(tile);
+    if (cached == tiles_.end())
+    {
+        tileLru_.push_front(tile);
+        cached = tiles_.emplace(tile, TDisplayTile()).first;
+        cached->second.lru = tileLru_.begin();
     }
-    else if (renderingType_ == R_COMPOSITE_COLOUR)
+    else
     {
-        tbb::parallel_for(size_t(0), size_t(height_),
-        [&](size_t row)
-        {
-            for (uint16_t col=0; col<width_; ++col)
-            {
-                EChannel channel = EChannel(iiqFile_[curSensorPlus_]->FC(row, col));
-                uint8_t* pixel = rawData8_ + (row*width_ + col)*3;
-                pixel[0] = pixel[1] = pixel[2] = 0;
-                if (chnlEnabled[channel])
-                {
-                    static int8_t idx[C_ALL] = { 0, 1, 2, 1 };
-                    pixel[idx[channel]] = TO_8_BIT(getRawData(channel,row,col));
-                }
-            }
-        });
+        tileCacheUsed_ -= cached->second.image.sizeInBytes();
+        tileLru_.splice(tileLru_.begin(), tileLru_, cached->second.lru);
     }
-    else if (renderingType_ == R_COMPOSITE_GRAY)
+
+    cached->second.image = image;
+    cached->second.version = version;
+    tileCacheUsed_ += image.sizeInBytes();
+
+    evictTiles();
+}
+
+// drops least recently shown tiles over the memory ceiling, the ones
+// in requested view are kept whatever it takes
+void IIQRawImage::evictTiles()
+{
+    auto it = tileLru_.end();
+    while (tileCacheUsed_ > tileCacheBudget_ && it != tileLru_.begin())
     {
-        tbb::parallel_for(size_t(0), size_t(height_),
-        [&](size_t row)
-        {
-            for (uint16_t col=0; col<width_; ++col)
-            {
-                EChannel channel = EChannel(iiqFile_[curSensorPlus_]->FC(row, col));
-                uint8_t* pixel = rawData8_ + (row*width_ + col)*3;
-                if (chnlEnabled[channel])
-                {
-                    pixel[0] = pixel[1] = pixel[2] = TO_8_BIT(getRawData(channel,row,col));
-                }
-                else
-                    pixel[0] = pixel[1] = pixel[2] = 0;
-            }
-        });
+        --it;
+        if (int(*it >> 32) == requestedLevel_ && tileRect(*it).intersects(requestedView_))
+            continue;
+
+        auto cached = tiles_.find(*it);
+        tileCacheUsed_ -= cached->second.image.sizeInBytes();
+        tiles_.erase(cached);
+        it = tileLru_.erase(it);
     }
+}
 
-    // update pixmap
-    QImage image(rawData8_, width_, height_, 3*width_, QImage::Format_RGB888);
-    rawPixmap_.convertFromImage(image);
+// whether all tiles of the requested view have been rendered
+bool IIQRawImage::viewRendered()
+{
+    if (requestedLevel_ < 0)
+        return false;
+    if (requestedView_.isEmpty())
+        return true;
+
+    QSize count = tileCount(requestedLevel_);
+    int span = RENDER_TILE_SIZE << requestedLevel_;
+    int lastTileX = std::min(requestedView_.right()/span, count.width()-1);
+    int lastTileY = std::min(requestedView_.bottom()/span, count.height()-1);
+    for (int ty=std::min(requestedView_.top()/span, count.height()-1); ty<=lastTileY; ++ty)
+        for (int tx=std::min(requestedView_.left()/span, count.width()-1); tx<=lastTileX; ++tx)
+            if (tiles_.find(tileAt(requestedLevel_, tx, ty)) == tiles_.end())
+                return false;
+
+    return true;
+}
+
+// the most reduced level still not smaller than the view scale
+int IIQRawImage::mipLevel() const
+{
+    int level = 0;
+    while (level < MIP_LEVELS && scale_*(2 << level) <= 1.0 &&
+           (width_ >> (level+1)) > 0 && (height_ >> (level+1)) > 0)
+        ++level;
 
-    #undef TO_8_BIT
+    return level;
 }
@@ -25,21 +25,46 @@
 
 #include "iiqcal.h"
 
-#include <QBitmap>
+#include <QPainter>
 #include <QFrame>
+#include <QImage>
 #include <QLabel>
 #include <QPaintEvent>
 #include <QPixmap>
 #include <QPoint>
+#include <QRect>
 #include <QSize>
+#include <QThread>
+#include <QTimer>
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #define MAX_RAW_VALUE     65535
 #define TOTAL_RAW_VALUES  MAX_RAW_VALUE+1
 
 #define MAX_ADAPTIVE_BLOCK  64
 
+// Raw is rendered to 8 bit in background in square tiles of this size,
+// the visible ones first
+#define RENDER_TILE_SIZE   256
+
+// Number of reduced levels the raw is rendered at for zoomed out display,
+// each level is twice smaller than the previous one
+#define MIP_LEVELS  4
+
+// Default memory ceiling for rendered tiles kept for display in megabytes
+#define DISPLAY_CACHE_MB  256
+
+// Longest side of the preview of the raw being loaded drawn over the
+// shown one
+#define PREVIEW_INSET_SIZE  320
+
 enum ERawRendering
 {
     R_RGB = 0,
@@ -90,6 +115,129 @@ inline uint16_t calc_median(uint16_t *stack, int count)
     return (result+stack[middle-1]+1)>>1;
 }
 
+// Rendered tile kept for display. Tiles of a level cover RENDER_TILE_SIZE
+// times 2^level pixels of the raw reduced by 2^level.
+struct TDisplayTile
+{
+    QImage image;               // display format, drawn as is
+    uint32_t version = 0;       // version of the raw area it shows
+    std::list<quint64>::iterator lru;
+};
+
+// Rendering parameters of the raw
+struct TRenderParams
+{
+    ERawRendering renderingType = R_RGB;
+    double contrast = 0;
+    double contrMidpoint = 0.5;
+    double exposure[5] = { 1, 1, 1, 1, 1 };
+    uint16_t blckLevels[4] = { 0, 0, 0, 0 };
+    bool blackLevelsZeroed = true;
+    bool applyGamma = true;
+    bool chnlEnabled[4] = { true, true, true, true };
+};
+
+// ------------------------------
+//      RawCurves class
+// ------------------------------
+// 8 bit display tables of the channels mapping raw values straight to
+// output, disabled channels are zeroed and there is an extra zero one
+class RawCurves
+{
+public:
+
+    RawCurves();
+
+    // regenerates tables of the channels with changed parameters
+    void generate(const TRenderParams& params);
+
+    const uint8_t* lut(int ch) const { return luts_.data() + size_t(ch)*TOTAL_RAW_VALUES; }
+    const TRenderParams& params() const { return params_; }
+
+private:
+    std::vector<uint8_t> luts_;
+    std::vector<float> toneCurve_;   // contrast and gamma sampled at knots
+    TRenderParams params_;           // parameters tables are generated for
+    bool valid_;
+};
+
+// Quick look at the raw with a pixel per 2x2 CFA block
+QImage renderSuperpixels(IIQFile& iiqFile, const RawCurves& curves);
+
+// Area of the raw at 1:1 from its pixels row by row, each 2x2 CFA block
+// in the colour of its pixels. Area starts at even visible row and
+// column and is even sized.
+QImage renderRawArea(IIQFile& iiqFile, const std::vector<uint16_t>& pixels,
+                     int width, int height, const RawCurves& curves);
+
+// Tile of the raw to render and its version at the time of request,
+// the area of the raw is rendered reduced by 2^level
+struct TRenderTile
+{
+    quint64 tile;
+    uint32_t version;
+    QRect rect;
+    int level;
+};
+
+// ------------------------------
+//      RawRenderer class
+// ------------------------------
+// Renders tiles of the raw in background. Only the latest request is
+// worked on - the one being rendered is abandoned once a new one comes.
+// Each tile is posted back as soon as it is ready.
+class RawRenderer : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    RawRenderer(QObject* parent = 0);
+    ~RawRenderer();
+
+    // replaces current request, tiles are rendered in the given order
+    void render(IIQFile* iiqFile, const TRenderParams& params,
+                std::vector<TRenderTile>&& tiles);
+
+    // abandons rendering and waits until the raw is not accessed
+    void stop();
+
+Q_SIGNALS:
+    void tileRendered(quint64 tile, quint32 version, const QImage& image);
+
+protected:
+    void run();
+
+private:
+    // request being rendered
+    struct TRequest
+    {
+        IIQFile* iiqFile = 0;
+        TRenderParams params;
+        std::vector<TRenderTile> tiles;
+    };
+
+    bool abandoned(uint32_t request) const { return request != request_; }
+    void renderRequest(TRequest& request, uint32_t id);
+    template <class CFA>
+    void renderTile(IIQFile& iiqFile, const TRenderParams& params,
+                    const QRect& rect, QImage& image, CFA cfa);
+    template <class CFA>
+    void renderReducedTile(IIQFile& iiqFile, const TRenderParams& params,
+                           const QRect& rect, int level, QImage& image, CFA cfa);
+
+    std::mutex mutex_;
+    std::condition_variable requestCond_;
+    std::condition_variable idleCond_;
+    TRequest pending_;
+    bool hasPending_;
+    bool busy_;
+    bool quit_;
+    std::atomic<uint32_t> request_;
+
+    RawCurves curves_;
+};
+
 // ------------------------------
 //      IIQRawImage class
 // ------------------------------
@@ -97,8 +245,10 @@ class IIQRawImage : public QLabel
 {
     Q_OBJECT
 
-    QPixmap rawPixmap_;
-    QBitmap defBitmap_;
+    // defects in image coordinates, point columns are kept sorted for
+    // each row so visible ones are found without walking all of them
+    std::vector<std::vector<uint16_t>> defRows_;
+    std::vector<uint16_t> defCols_;
 
     QColor defColour_;
 
@@ -109,8 +259,40 @@ class IIQRawImage : public QLabel
 
     bool curSensorPlus_;
     std::unique_ptr<IIQFile> iiqFile_[2];   // rawData_;
+    uint64_t corrHash_[2];      // correction of the raw not shown, current one follows calFile_
     IIQCalFile calFile_;
-    uint8_t* rawData8_;
+
+    // rendered tiles of the level needed for the view and around it,
+    // least recently shown ones go once over the memory ceiling but the
+    // ones in view are kept. The last row and column of tiles on each
+    // level take the remainder of the raw. Areas of the raw are
+    // versioned by full size tiles so tiles rendered before a change
+    // are dropped, stale images are shown until rendered again.
+    std::unordered_map<quint64, TDisplayTile> tiles_;
+    std::list<quint64> tileLru_;    // most recently shown first
+    size_t tileCacheUsed_;
+    size_t tileCacheBudget_;
+    std::vector<uint32_t> tileVersion_;
+    uint32_t renderVersion_;
+    RawRenderer* renderer_;
+    QTimer renderRequest_;
+    QRect requestedView_;
+    int requestedLevel_;
+
+    // quick look at the raw being loaded shown in place while no raw is
+    // or over the corner of the shown one, then filling in tiles in view
+    // of the loaded one until rendered
+    QImage preview_;
+    QSize previewSize_;
+    bool previewPending_;
+    double previewScale_;       // scale to go back to if load is cancelled
+    QRect previewInset_;        // where it was last drawn over the shown raw
+
+    // area of the raw being loaded decoded at 1:1, shown in place over
+    // its preview or below the preview over the shown raw
+    QImage region_;
+    QRect regionArea_;
+    QRect regionInset_;
 
     ERawRendering renderingType_;
 
@@ -122,6 +304,8 @@ class IIQRawImage : public QLabel
 
     bool applyDefectCorr_;
 
+    bool showCorrStats_;
+
     bool pauseUpdates_;
 
     double scale_;
@@ -129,9 +313,6 @@ class IIQRawImage : public QLabel
     // displaying options
     int pX, pY;
 
-    // channel curves
-    uint16_t chnlCurves_[4][TOTAL_RAW_VALUES];
-
     // adjustment parameters
     double contrast_;
     double contrMidpoint_;
@@ -166,9 +347,36 @@ public:
         return EChannel(iiqFile_[curSensorPlus_] ? iiqFile_[curSensorPlus_]->FC(row, col) : 0);
     }
 
-    // raw image setters
-    void setRawImage(std::unique_ptr<IIQFile>& iiqFile, double scale);
+    // CFA pattern of the raw for dispatchCFA()
+    inline unsigned getCfaPattern()
+    {
+        return iiqFile_[curSensorPlus_] ? iiqFile_[curSensorPlus_]->cfaPattern() : 0;
+    }
+
+    // raw image setters - raw already corrected as the given correction
+    // hash (see IIQCalFile::corrHash) says is not corrected again if that
+    // matches, returns true in that case. Previous raw of the same sensor
+    // mode is handed back in iiqFile.
+    bool setRawImage(std::unique_ptr<IIQFile>& iiqFile, double scale, uint64_t corrHash = 0);
     void clearRawImage();
+
+    // preview of the raw of the given size being loaded, shown in place
+    // when there is no raw shown yet, otherwise over the top right corner
+    // of the view while the shown raw stays editable. It then fills in the
+    // loaded raw until rendered. Clearing brings back the current view.
+    void setPreview(const QImage& image, int width, int height, double scale);
+    void clearPreview();
+
+    // area of the raw being loaded in visible raw coordinates, rendered
+    // at 1:1 and shown until the preview is cleared or the raw is set
+    void setRegionPreview(const QImage& image, const QRect& area);
+
+    TRenderParams renderParams() const;
+
+    // memory ceiling for rendered tiles, tiles in view are always kept
+    void setDisplayCacheSize(size_t size);
+    size_t displayCacheSize() const { return tileCacheBudget_; }
+
     bool rawLoaded() { return (bool)iiqFile_[curSensorPlus_]; }
     bool rawLoaded(bool sensorPlus) { return (bool)iiqFile_[sensorPlus]; }
     bool hasCalFile() { return calFile_.valid(curSensorPlus_); }
@@ -176,7 +384,12 @@ public:
     std::unique_ptr<IIQFile>& getRawImage() { return iiqFile_[curSensorPlus_]; }
     std::unique_ptr<IIQFile>& getRawImage(bool sensorPlus) { return iiqFile_[sensorPlus]; }
 
-    void setSensorPlus(bool sensorPlus, double scale);
+    // correction the raw has, zero if there is no raw
+    uint64_t getCorrHash(bool sensorPlus);
+
+    // switches to the raw of the other sensor mode, it is corrected again
+    // only if calibration has changed since and true is returned then
+    bool setSensorPlus(bool sensorPlus, double scale, bool correct = true);
     bool getSensorPlus() { return curSensorPlus_; };
     bool supportsSensorPlus() { return calFile_.hasSensorPlus(); }
 
@@ -184,12 +397,14 @@ public:
     void discardChanges();
     void updateDefects()
     {
-        updateDefectsBitmap();
+        updateDefectIndex();
         repaint();
     }
     bool hasUnsavedChanges() { return calFile_.hasUnsavedChanges(); }
     void setDefectColour(QColor &colour);
     void setDefectCorr(bool applyDefectCorr);
+    bool getDefectCorr() { return applyDefectCorr_; }
+    void showCorrStats(bool show);
     void enableDefPoints(bool enable);
     void enableDefCols(bool enable);
     void setDefectSettingMode(EDefectMode mode);
@@ -247,17 +462,20 @@ public:
     // size hint
     QSize sizeHint() const;
 
+public Q_SLOTS:
+    // repaint of overlays that stay in place over the visible area
+    void refreshOverlays() { if (showCorrStats_ || previewPending_ || !region_.isNull()) update(); }
+
+private Q_SLOTS:
+    void requestRender();
+    void tileRendered(quint64 tile, quint32 version, const QImage& image);
+
 Q_SIGNALS:
     void imageCursorPosUpdated(uint16_t row, uint16_t col);
     void defectsChanged();
 
 private:
 
-    inline uint16_t getRawDataEnabled(uint8_t ch, int row, int col)
-    {
-        return chnlEnabled[ch] ? chnlCurves_[ch][iiqFile_[curSensorPlus_]->getRAW(row, col)] : 0;
-    }
-
     inline const std::string getPhaseOneSerial()
     {
         return iiqFile_[0] ? iiqFile_[0]->getPhaseOneSerial()
@@ -265,26 +483,49 @@ private:
                                           : std::string());
     }
 
-    inline uint16_t getRawData(uint8_t ch, uint16_t row, uint16_t col)
+    // renderer must not read the raw while it changes
+    void stopRendering()
     {
-        return chnlCurves_[ch][iiqFile_[curSensorPlus_]->getRAW(row, col)];
+        renderer_->stop();
+        requestedView_ = QRect();
     }
 
+    // preview of the raw being loaded is shown in place of none
+    bool previewShown() const { return previewPending_ && !iiqFile_[curSensorPlus_]; }
+
     void calcViewpointOffsets()
     {
+        QSize size = previewShown() ? previewSize_ : QSize(width_, height_);
         pX=pY=0;
-        if (width() >= width_*scale_)
-            pX = roundToInt((width()-width_*scale_)/2);
-        if (height() >= height_*scale_)
-            pY = roundToInt((height()-height_*scale_)/2);
+        if (width() >= size.width()*scale_)
+            pX = roundToInt((width()-size.width()*scale_)/2);
+        if (height() >= size.height()*scale_)
+            pY = roundToInt((height()-size.height()*scale_)/2);
     }
     void paintEvent(QPaintEvent *p);
+    void drawDefects(QPainter& painter, const QRect& imageRect, const QPoint& offset);
+    void drawCorrStats(QPainter& painter);
+    void drawPreviewInset(QPainter& painter);
+    void drawRegionInset(QPainter& painter);
     void resizeEvent(QResizeEvent *event);
     void mouseMoveEvent(QMouseEvent * e);
     void mousePressEvent(QMouseEvent * e);
-    void updateRaw();
-    void updateDefectsBitmap();
-    void generateCurves(EChannel channel = C_ALL);
+    void updateRaw(const QRect& area = QRect());
+    void resetTiles();
+    QSize tileCount(int level) const;
+    quint64 tileAt(int level, int col, int row) const;
+    QRect tileRect(quint64 tile) const;
+    uint32_t tileVersion(const QRect& rect) const;
+    bool drawTile(QPainter& painter, quint64 tile, const QRect& area, const QPoint& offset);
+    void putTile(quint64 tile, const QImage& image, uint32_t version);
+    void evictTiles();
+    bool viewRendered();
+    QRect viewRect();
+    int mipLevel() const;
+    void updateArea(const QRect& area);
+    void updateDefectCorr(int col, int row);
+    void updateDefectIndex();
+    void updateDefect(int col, int row);
 };
 
 #endif
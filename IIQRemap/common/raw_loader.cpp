@@ -0,0 +1,609 @@
+/*
+    raw_loader.cpp - background loading of IIQ raw files
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#define NOMINMAX
+
+#include "raw_loader.h"
+#include "raw_image.h"
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <tbb/tbb.h>
+
+#include <math.h>
+
+#include <algorithm>
+
+#if defined(WIN32) || defined(_WIN32)
+#define TO_STDSTR(qs)  (qs.toStdWString())
+#else
+#define TO_STDSTR(qs)  (qs.toStdString())
+#endif
+
+// --------------------------------------------------------
+//    helper functions
+// --------------------------------------------------------
+void calcRawStats(IIQFile& iiqFile, TRawStats& stats)
+{
+    int rawWidth = iiqFile.imgdata.sizes.width;
+    int rawHeight = iiqFile.imgdata.sizes.height;
+    int nValues = (rawWidth * rawHeight)>>2;
+
+    stats = TRawStats();
+    stats.minVal[C_RED] = stats.minVal[C_GREEN] = stats.minVal[C_BLUE] = stats.minVal[C_GREEN2] = 0xFFFF;
+
+    // calculate mean and stddev
+    dispatchCFA(iiqFile.cfaPattern(), [&](auto cfa)
+    {
+        for (int row=0; row<rawHeight; ++row)
+            for (int col=0; col<rawWidth; ++col)
+            {
+                EChannel channel = EChannel(cfa.color(row,col));
+                uint16_t val = iiqFile.getRAW(row,col);
+                if (stats.maxVal[channel]<val)
+                    stats.maxVal[channel] = val;
+                if (stats.minVal[channel]>val)
+                    stats.minVal[channel] = val;
+                stats.avgVal[channel] += val;
+                stats.stdDev[channel] += double(val)*val;
+            }
+    });
+
+    for (int ch=C_RED; ch<C_ALL; ++ch)
+    {
+        stats.stdDev[ch] = sqrt((stats.stdDev[ch]-(stats.avgVal[ch]*stats.avgVal[ch]/nValues))/(nValues-1));
+        stats.avgVal[ch] /= nValues;
+    }
+}
+
+QStringList folderRaws(const QString& folder)
+{
+    QDir dir(folder);
+    QStringList fileNames;
+    for (const auto& name: dir.entryList(QStringList() << "*.iiq", QDir::Files, QDir::Name | QDir::IgnoreCase))
+        fileNames.append(dir.absoluteFilePath(name));
+
+    return fileNames;
+}
+
+qint64 fileModified(const QString& fileName)
+{
+    return QFileInfo(fileName).lastModified().toMSecsSinceEpoch();
+}
+
+// Calibration to correct the raw with - the given one for the same back
+// merged with the one in the raw, otherwise the one in the raw
+static void rawCalFile(IIQFile& iiqFile, IIQCalFile& calFile)
+{
+    if (!calFile.valid() || calFile.getCalSerial() != iiqFile.getPhaseOneSerial())
+        calFile = iiqFile.getIIQCalFile();
+    else if (auto loadedCal = iiqFile.getIIQCalFile(); calFile.mergable(loadedCal))
+        calFile.merge(loadedCal);
+}
+
+// --------------------------------------------------------
+//    RawLoader class
+// --------------------------------------------------------
+RawLoader::RawLoader(const QStringList& fileNames,
+                     const IIQCalFile& calFile,
+                     bool applyDefectCorr,
+                     QObject* parent)
+    : QThread(parent),
+      frame_(std::make_unique<TRawFrame>()),
+      cancelled_(false),
+      done_(false),
+      concurrency_(0),
+      result_(LIBRAW_SUCCESS)
+{
+    // stacks are limited to the first MAX_RAWS files
+    frame_->fileNames = fileNames.mid(0, MAX_RAWS);
+    frame_->calFile = calFile;
+    frame_->defectCorr = applyDefectCorr;
+}
+
+RawLoader::~RawLoader()
+{
+    cancel();
+    wait();
+}
+
+void RawLoader::setPreview(const TRenderParams& params)
+{
+    previewCurves_ = std::make_unique<RawCurves>();
+    previewCurves_->generate(params);
+}
+
+void RawLoader::cancel()
+{
+    cancelled_ = true;
+
+    // interrupts decoding or correction in progress
+    std::lock_guard<std::mutex> lock(activeMutex_);
+    for (auto file: activeFiles_)
+        file->setCancelFlag();
+}
+
+void RawLoader::addActiveFile(IIQFile* file)
+{
+    std::lock_guard<std::mutex> lock(activeMutex_);
+    activeFiles_.push_back(file);
+    file->set_progress_handler(progressCallback, this);
+}
+
+void RawLoader::clearActiveFiles()
+{
+    std::lock_guard<std::mutex> lock(activeMutex_);
+    for (auto file: activeFiles_)
+        file->set_progress_handler(0, 0);
+    activeFiles_.clear();
+}
+
+// LibRaw cancels processing when callback returns non zero
+int RawLoader::progressCallback(void* data, enum LibRaw_progress, int, int)
+{
+    return static_cast<RawLoader*>(data)->cancelled_ ? 1 : 0;
+}
+
+void RawLoader::run()
+{
+    if (concurrency_ > 0)
+    {
+        tbb::task_arena arena(concurrency_);
+        arena.execute([this] { load(); });
+    }
+    else
+        load();
+
+    done_ = true;
+}
+
+void RawLoader::load()
+{
+    const auto& fileNames = frame_->fileNames;
+    const int steps = fileNames.size() + 2;
+
+    frame_->modified = fileModified(fileNames.at(0));
+    frame_->iiqFile = std::make_unique<IIQFile>();
+    addActiveFile(frame_->iiqFile.get());
+
+    Q_EMIT progress(0, steps, tr("Decoding %1").arg(QFileInfo(fileNames.at(0)).fileName()));
+    result_ = loadRaw(*frame_->iiqFile, 0);
+    if (result_ == LIBRAW_SUCCESS && !cancelled_)
+        previewRaw(*frame_->iiqFile);
+
+    // check if we have multiple files and load up a stack
+    if (result_ == LIBRAW_SUCCESS && fileNames.size() > 1)
+        result_ = loadRawStack();
+
+    if (result_ == LIBRAW_SUCCESS && !cancelled_)
+    {
+        Q_EMIT progress(fileNames.size(), steps, tr("Applying calibration"));
+        correctRaw();
+    }
+
+    if (result_ == LIBRAW_SUCCESS && !cancelled_)
+    {
+        Q_EMIT progress(fileNames.size() + 1, steps, tr("Gathering raw stats"));
+        calcRawStats(*frame_->iiqFile, frame_->stats);
+    }
+
+    clearActiveFiles();
+    if (cancelled_ || result_ != LIBRAW_SUCCESS)
+        frame_->iiqFile.reset();
+    else
+        Q_EMIT progress(steps, steps, tr("Done"));
+}
+
+// Opens and decodes a single raw - the first one sets the camera for
+// the others in the stack
+int RawLoader::loadRaw(IIQFile& file, int index)
+{
+    const auto& fileName = frame_->fileNames.at(index);
+    const auto& firstFile = frame_->iiqFile;
+    int result = LIBRAW_SUCCESS;
+
+    if ((result = file.open_file(TO_STDSTR(fileName).c_str())) != LIBRAW_SUCCESS)
+        errorText_ = tr("Error opening file\n%1!").arg(fileName);
+    else if (!file.isPhaseOne() || file.getPhaseOneSerial().empty())
+    {
+        result = LIBRAW_FILE_UNSUPPORTED;
+        errorText_ = tr("File %1\ndoes not seem to be Phase One IIQ file!").arg(fileName);
+    }
+    else if (index > 0 && firstFile->getPhaseOneSerial() != file.getPhaseOneSerial())
+    {
+        result = LIBRAW_FILE_UNSUPPORTED;
+        errorText_ = tr("File %1 is not\nfrom the same Phase One camera as the first file!").arg(fileName);
+    }
+    else if (index > 0 && firstFile->isSensorPlus() != file.isSensorPlus())
+    {
+        result = LIBRAW_FILE_UNSUPPORTED;
+        auto msg = firstFile->isSensorPlus() ? tr("File %1 is not\ntaken with Sensor+ as the first file!")
+                                            : tr("File %1 is taken\nwith Sensor+ unlike the first file!");
+        errorText_ = msg.arg(fileName);
+    }
+    else
+    {
+        if (index == 0)
+            previewThumbnail(file, fileName);
+
+        if ((result = file.unpack()) != LIBRAW_SUCCESS && !cancelled_)
+            errorText_ = tr("Error unpacking IIQ data from file\n%1!").arg(fileName);
+    }
+
+    return result;
+}
+
+// Embedded preview of the opened raw
+void RawLoader::previewThumbnail(IIQFile& file, const QString& fileName)
+{
+    TIIQThumbnail thumbnail;
+    if (!previewCurves_ || !readIIQThumbnail(TO_STDSTR(fileName), thumbnail))
+        return;
+
+    QImage image(thumbnail.rgb.data(), thumbnail.width, thumbnail.height,
+                 3*thumbnail.width, QImage::Format_RGB888);
+    Q_EMIT preview(image.convertToFormat(QImage::Format_RGB32),
+                   file.imgdata.sizes.width, file.imgdata.sizes.height);
+}
+
+// Decoded raw before corrections at half size
+void RawLoader::previewRaw(IIQFile& file)
+{
+    if (previewCurves_)
+        Q_EMIT preview(renderSuperpixels(file, *previewCurves_),
+                       file.imgdata.sizes.width, file.imgdata.sizes.height);
+}
+
+// Decodes the rest of the files and calculates the median into the first
+int RawLoader::loadRawStack()
+{
+    const auto& fileNames = frame_->fileNames;
+    const int rawCount = fileNames.size();
+    auto iiqFiles = std::make_unique<IIQFile[]>(rawCount-1);
+    int result = LIBRAW_SUCCESS;
+
+    for (int i=1; result==LIBRAW_SUCCESS && !cancelled_ && i<rawCount; ++i)
+    {
+        addActiveFile(&iiqFiles[i-1]);
+        Q_EMIT progress(i, rawCount + 2, tr("Decoding %1").arg(QFileInfo(fileNames.at(i)).fileName()));
+        result = loadRaw(iiqFiles[i-1], i);
+    }
+
+    if (result == LIBRAW_SUCCESS && !cancelled_)
+    {
+        IIQFile& file = *frame_->iiqFile;
+        uint16_t* data = file.imgdata.rawdata.raw_image;
+
+        tbb::parallel_for(size_t(0), size_t(file.imgdata.sizes.raw_height),
+        [&](size_t row)
+        {
+            int i = row*file.imgdata.sizes.raw_width;
+            for (uint16_t col=0; col<file.imgdata.sizes.raw_width; ++col, ++i)
+            {
+                uint16_t stack[MAX_RAWS];
+                stack[0] = data[i];
+                for (int cnt=1; cnt<rawCount; cnt++)
+                    stack[cnt] = iiqFiles[cnt-1].imgdata.rawdata.raw_image[i];
+                data[i] = calc_median(stack, rawCount);
+            }
+        });
+    }
+
+    // stack files go before the loader forgets them
+    clearActiveFiles();
+    addActiveFile(frame_->iiqFile.get());
+
+    return result;
+}
+
+// Corrects with the calibration the raw is going to be shown with
+void RawLoader::correctRaw()
+{
+    auto& iiqFile = frame_->iiqFile;
+    auto& calFile = frame_->calFile;
+    bool sensorPlus = iiqFile->isSensorPlus();
+
+    // read all needed resources and release file handle
+    iiqFile->closeFileStream();
+    rawCalFile(*iiqFile, calFile);
+
+    iiqFile->applyPhaseOneCorr(calFile, sensorPlus, frame_->defectCorr);
+    frame_->corrHash = calFile.corrHash(sensorPlus, frame_->defectCorr);
+}
+
+// --------------------------------------------------------
+//    RegionLoader class
+// --------------------------------------------------------
+RegionLoader::RegionLoader(const QString& fileName,
+                           const IIQCalFile& calFile,
+                           bool applyDefectCorr,
+                           const TRenderParams& params,
+                           QObject* parent)
+    : QThread(parent),
+      fileName_(fileName),
+      applyDefectCorr_(applyDefectCorr),
+      curves_(std::make_unique<RawCurves>()),
+      position_(-1, -1),
+      pending_(true),
+      cancelled_(false)
+{
+    calFile_ = calFile;
+    curves_->generate(params);
+}
+
+RegionLoader::~RegionLoader()
+{
+    cancel();
+    wait();
+}
+
+void RegionLoader::setPosition(int row, int col)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        position_ = QPoint(col, row);
+        pending_ = true;
+    }
+    positionCond_.notify_one();
+}
+
+void RegionLoader::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+    }
+    positionCond_.notify_one();
+    iiqFile_.setCancelFlag();
+}
+
+void RegionLoader::run()
+{
+    if (iiqFile_.open_file(TO_STDSTR(fileName_).c_str()) != LIBRAW_SUCCESS ||
+        !iiqFile_.isPhaseOne() || cancelled_)
+        return;
+
+    // same calibration as the full load corrects the raw with
+    const bool sensorPlus = iiqFile_.isSensorPlus();
+    rawCalFile(iiqFile_, calFile_);
+    if (!iiqFile_.beginRegionDecode(calFile_, sensorPlus, applyDefectCorr_))
+        return;
+
+    // even sized area on CFA block boundaries
+    const auto& sizes = iiqFile_.imgdata.sizes;
+    const int width = std::min(REGION_PREVIEW_SIZE, int(sizes.width)) & -2;
+    const int height = std::min(REGION_PREVIEW_SIZE, int(sizes.height)) & -2;
+    std::vector<uint16_t> pixels;
+
+    while (width > 0 && height > 0)
+    {
+        QPoint position;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            positionCond_.wait(lock, [this] { return pending_ || cancelled_; });
+            if (cancelled_)
+                break;
+            position = position_;
+            pending_ = false;
+        }
+
+        if (!QRect(0, 0, sizes.width, sizes.height).contains(position))
+            position = QPoint(sizes.width/2, sizes.height/2);
+
+        QRect area(std::clamp(position.x() - width/2, 0, sizes.width - width) & -2,
+                   std::clamp(position.y() - height/2, 0, sizes.height - height) & -2,
+                   width, height);
+        TRawRect rawArea;
+        rawArea.col = area.x() + sizes.left_margin;
+        rawArea.row = area.y() + sizes.top_margin;
+        rawArea.width = width;
+        rawArea.height = height;
+
+        if (iiqFile_.decodeRegion(rawArea, pixels) && !cancelled_)
+            Q_EMIT region(renderRawArea(iiqFile_, pixels, width, height, *curves_), area);
+    }
+
+    iiqFile_.endRegionDecode();
+}
+
+// --------------------------------------------------------
+//    RawFrameCache class
+// --------------------------------------------------------
+bool RawFrameCache::contains(const QString& fileName) const
+{
+    for (const auto& frame: frames_)
+        if (frame->fileNames.at(0) == fileName)
+            return frame->modified == fileModified(fileName);
+
+    return false;
+}
+
+void RawFrameCache::put(std::unique_ptr<TRawFrame> frame, const QStringList& priority)
+{
+    if (!frame || !frame->iiqFile || frame->fileNames.size() != 1)
+        return;
+
+    // replace any older copy
+    remove(frame->fileNames.at(0));
+
+    used_ += frame->memoryUsed();
+    frames_.push_front(std::move(frame));
+
+    for (auto it = priority.rbegin(); it != priority.rend(); ++it)
+        touch(*it);
+
+    evict();
+}
+
+void RawFrameCache::touch(const QString& fileName)
+{
+    for (auto it = frames_.begin(); it != frames_.end(); ++it)
+        if ((*it)->fileNames.at(0) == fileName)
+        {
+            frames_.splice(frames_.begin(), frames_, it);
+            break;
+        }
+}
+
+std::unique_ptr<TRawFrame> RawFrameCache::take(const QString& fileName)
+{
+    auto frame = remove(fileName);
+    if (frame && frame->modified != fileModified(fileName))
+        frame.reset();
+
+    return frame;
+}
+
+std::unique_ptr<TRawFrame> RawFrameCache::remove(const QString& fileName)
+{
+    for (auto it = frames_.begin(); it != frames_.end(); ++it)
+        if ((*it)->fileNames.at(0) == fileName)
+        {
+            auto frame = std::move(*it);
+            frames_.erase(it);
+            used_ -= frame->memoryUsed();
+            return frame;
+        }
+
+    return std::unique_ptr<TRawFrame>();
+}
+
+void RawFrameCache::evict()
+{
+    while (used_ > budget_ && !frames_.empty())
+    {
+        used_ -= frames_.back()->memoryUsed();
+        frames_.pop_back();
+    }
+}
+
+// --------------------------------------------------------
+//    RawPrefetcher class
+// --------------------------------------------------------
+RawPrefetcher::RawPrefetcher(QObject* parent)
+    : QObject(parent),
+      applyDefectCorr_(false),
+      loader_(0)
+{
+}
+
+RawPrefetcher::~RawPrefetcher()
+{
+    cancel();
+}
+
+void RawPrefetcher::prefetch(const QStringList& fileNames,
+                             const IIQCalFile& calFile,
+                             bool applyDefectCorr)
+{
+    wanted_ = fileNames;
+    queue_.clear();
+    for (const auto& fileName: fileNames)
+        if (!cache_.contains(fileName))
+            queue_.append(fileName);
+
+    calFile_ = calFile;
+    applyDefectCorr_ = applyDefectCorr;
+
+    // keep decoding the current one if it is still wanted
+    if (loader_)
+    {
+        const auto& fileName = loader_->fileNames().at(0);
+        if (queue_.contains(fileName))
+            queue_.removeAll(fileName);
+        else
+            stopLoader();
+    }
+
+    startNext();
+}
+
+void RawPrefetcher::cancel()
+{
+    wanted_.clear();
+    queue_.clear();
+    stopLoader();
+}
+
+RawLoader* RawPrefetcher::takeLoader(const QString& fileName)
+{
+    RawLoader* loader = 0;
+    if (loader_ && loader_->fileNames().at(0) == fileName)
+    {
+        loader = loader_;
+        loader_ = 0;
+        loader->disconnect(this);
+        loader->setParent(0);
+    }
+
+    return loader;
+}
+
+// Loader is cancelled without waiting, it goes once finished
+void RawPrefetcher::stopLoader()
+{
+    if (loader_)
+    {
+        loader_->disconnect(this);
+        loader_->cancel();
+        connect(loader_, SIGNAL(finished()), loader_, SLOT(deleteLater()));
+        if (loader_->done())
+        {
+            loader_->wait();
+            loader_->deleteLater();
+        }
+        loader_ = 0;
+    }
+}
+
+void RawPrefetcher::startNext()
+{
+    if (loader_ || queue_.isEmpty())
+        return;
+
+    QStringList fileNames;
+    fileNames.append(queue_.takeFirst());
+
+    // half of the threads are left for what is being shown
+    loader_ = new RawLoader(fileNames, calFile_, applyDefectCorr_, this);
+    loader_->setConcurrency(std::max(1, tbb::this_task_arena::max_concurrency()/2));
+    connect(loader_, SIGNAL(finished()), this, SLOT(loaderFinished()));
+
+    loader_->start(QThread::LowPriority);
+}
+
+void RawPrefetcher::loaderFinished()
+{
+    // ignore loaders finished before being handed over or stopped
+    if (!loader_ || sender() != loader_)
+        return;
+
+    RawLoader* loader = loader_;
+    loader_ = 0;
+    loader->wait();
+    loader->deleteLater();
+
+    if (loader->result() == LIBRAW_SUCCESS && !loader->cancelled())
+        cache_.put(loader->takeFrame(), wanted_);
+
+    startNext();
+}
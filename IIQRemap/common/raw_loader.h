@@ -0,0 +1,299 @@
+/*
+    raw_loader.h - background loading of IIQ raw files
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#ifndef IIQ_RAW_LOADER_H
+#define IIQ_RAW_LOADER_H
+
+#include "iiqcal.h"
+
+#include <QImage>
+#include <QRect>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Maximum number of raws in a median stack
+#define MAX_RAWS  7
+
+// Default memory budget for prefetched raws in megabytes
+#define FRAME_CACHE_MB  2048
+
+// Size of the area around the cursor shown at 1:1 while a raw loads
+#define REGION_PREVIEW_SIZE  256
+
+class RawCurves;
+struct TRenderParams;
+
+// Per channel stats of the raw
+struct TRawStats
+{
+    uint16_t maxVal[4] = { 0, 0, 0, 0 };
+    uint16_t minVal[4] = { 0, 0, 0, 0 };
+    double stdDev[4] = { 0, 0, 0, 0 };
+    double avgVal[4] = { 0, 0, 0, 0 };
+};
+
+// Gathers stats over the visible area of the raw
+void calcRawStats(IIQFile& iiqFile, TRawStats& stats);
+
+// IIQ files in the folder sorted by name
+QStringList folderRaws(const QString& folder);
+
+// Modification time of the file in ms, stale cached raws are detected by it
+qint64 fileModified(const QString& fileName);
+
+// Decoded and corrected raw with everything needed to show it. Cached
+// frames are keyed by the file and its modification time, the correction
+// hash tells whether the raw can be shown without correcting it again.
+struct TRawFrame
+{
+    QStringList fileNames;
+    qint64 modified = 0;        // modification time of the first file
+    std::unique_ptr<IIQFile> iiqFile;
+    IIQCalFile calFile;         // calibration the raw is corrected with
+    bool defectCorr = false;    // whether defects are corrected
+    uint64_t corrHash = 0;      // IIQCalFile::corrHash() of applied correction
+    TRawStats stats;
+
+    size_t memoryUsed() const { return iiqFile ? iiqFile->memoryUsed() : 0; }
+};
+
+// ------------------------------
+//      RawLoader class
+// ------------------------------
+// Loads a raw or a median stack of raws in the background in stages -
+// decoding of each file, correction and stats. Rendering is left to
+// the caller once finished.
+class RawLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    RawLoader(const QStringList& fileNames,
+              const IIQCalFile& calFile,
+              bool applyDefectCorr,
+              QObject* parent = 0);
+    ~RawLoader();
+
+    // stops loading as soon as possible
+    void cancel();
+    bool cancelled() const { return cancelled_; }
+
+    // set once loading is over, right before the thread finishes
+    bool done() const { return done_; }
+
+    // limits number of threads used for decoding and correction,
+    // zero uses all of them (default)
+    void setConcurrency(int concurrency) { concurrency_ = concurrency; }
+
+    // enables preview() signals rendered with the parameters, must be
+    // set before the loader is started
+    void setPreview(const TRenderParams& params);
+
+    // files being loaded
+    const QStringList& fileNames() const { return frame_->fileNames; }
+
+    // results once finished, the loaded raw is empty on errors
+    int result() const { return result_; }
+    const QString& errorText() const { return errorText_; }
+    TRawFrame& frame() { return *frame_; }
+    std::unique_ptr<TRawFrame> takeFrame() { return std::move(frame_); }
+
+Q_SIGNALS:
+    void progress(int step, int steps, const QString& text);
+
+    // quick looks at the raw of the given visible size while loading -
+    // the embedded preview once the file is opened, then a pixel per
+    // CFA block of the raw once decoded
+    void preview(const QImage& image, int width, int height);
+
+protected:
+    void run();
+
+private:
+    void load();
+    int loadRaw(IIQFile& file, int index);
+    int loadRawStack();
+    void correctRaw();
+    void previewThumbnail(IIQFile& file, const QString& fileName);
+    void previewRaw(IIQFile& file);
+
+    void addActiveFile(IIQFile* file);
+    void clearActiveFiles();
+
+    static int progressCallback(void* data, enum LibRaw_progress stage,
+                                int iteration, int expected);
+
+    std::unique_ptr<TRawFrame> frame_;
+
+    std::atomic<bool> cancelled_;
+    std::atomic<bool> done_;
+    int concurrency_;
+    std::mutex activeMutex_;
+    std::vector<IIQFile*> activeFiles_;
+    std::unique_ptr<RawCurves> previewCurves_;
+
+    int result_;
+    QString errorText_;
+};
+
+// ------------------------------
+//      RegionLoader class
+// ------------------------------
+// Decodes and corrects the area around a position of the raw while
+// RawLoader loads it in full. Reads the file through an IIQFile of its
+// own, bands of rows decoded are kept for the next positions. Single
+// raws only, stacks need all of them decoded.
+class RegionLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    RegionLoader(const QString& fileName,
+                 const IIQCalFile& calFile,
+                 bool applyDefectCorr,
+                 const TRenderParams& params,
+                 QObject* parent = 0);
+    ~RegionLoader();
+
+    // centre of the area in visible raw coordinates, the raw centre is
+    // used outside of it. Replaces the position not decoded yet.
+    void setPosition(int row, int col);
+
+    // stops decoding as soon as possible
+    void cancel();
+
+Q_SIGNALS:
+    // area of the raw in visible coordinates rendered at 1:1
+    void region(const QImage& image, const QRect& area);
+
+protected:
+    void run();
+
+private:
+    QString fileName_;
+    IIQCalFile calFile_;
+    bool applyDefectCorr_;
+    std::unique_ptr<RawCurves> curves_;
+    IIQFile iiqFile_;
+
+    std::mutex mutex_;
+    std::condition_variable positionCond_;
+    QPoint position_;
+    bool pending_;
+    std::atomic<bool> cancelled_;
+};
+
+// ------------------------------
+//      RawFrameCache class
+// ------------------------------
+// Least recently used raws kept within the memory budget. Used from
+// the GUI thread only.
+class RawFrameCache
+{
+public:
+
+    RawFrameCache(size_t budget = size_t(FRAME_CACHE_MB)<<20)
+        : budget_(budget), used_(0) {}
+
+    void setBudget(size_t budget) { budget_ = budget; evict(); }
+    size_t budget() const { return budget_; }
+    size_t used() const { return used_; }
+
+    // Whether the file is cached and not modified since
+    bool contains(const QString& fileName) const;
+
+    // Puts the frame in front and evicts least recently used ones over
+    // the budget. Cached files in priority list are moved in front in
+    // that order first. Frame itself is dropped if it does not fit.
+    void put(std::unique_ptr<TRawFrame> frame, const QStringList& priority = QStringList());
+
+    // Takes the frame out of the cache, empty if not cached or the file
+    // has been modified since
+    std::unique_ptr<TRawFrame> take(const QString& fileName);
+
+    void clear() { frames_.clear(); used_ = 0; }
+
+private:
+    std::unique_ptr<TRawFrame> remove(const QString& fileName);
+    void touch(const QString& fileName);
+    void evict();
+
+    std::list<std::unique_ptr<TRawFrame>> frames_;  // most recent first
+    size_t budget_;
+    size_t used_;
+};
+
+// ------------------------------
+//      RawPrefetcher class
+// ------------------------------
+// Decodes and corrects raws likely to be shown next one at a time in
+// background and keeps them in the cache
+class RawPrefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    RawPrefetcher(QObject* parent = 0);
+    ~RawPrefetcher();
+
+    // Replaces the queue of files to prefetch, files already cached
+    // are skipped and the one being decoded is kept if still needed
+    void prefetch(const QStringList& fileNames, const IIQCalFile& calFile, bool applyDefectCorr);
+
+    // Stops decoding and drops the queue
+    void cancel();
+
+    // Takes a cached raw out of the cache
+    std::unique_ptr<TRawFrame> take(const QString& fileName) { return cache_.take(fileName); }
+
+    // Hands over the loader if it is decoding the file, caller gets
+    // ownership and it is safe to connect to its finished() signal
+    RawLoader* takeLoader(const QString& fileName);
+
+    RawFrameCache& cache() { return cache_; }
+
+private Q_SLOTS:
+    void loaderFinished();
+
+private:
+    void startNext();
+    void stopLoader();
+
+    RawFrameCache cache_;
+    QStringList wanted_;
+    QStringList queue_;
+    IIQCalFile calFile_;
+    bool applyDefectCorr_;
+    RawLoader* loader_;
+};
+
+#endif
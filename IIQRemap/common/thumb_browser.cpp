@@ -0,0 +1,259 @@
+/*
+    thumb_browser.cpp - browser of IIQ files with thumbnails
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#define NOMINMAX
+
+#include "thumb_browser.h"
+#include "raw_loader.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QIcon>
+#include <QPixmap>
+#include <QStandardPaths>
+
+#include <tbb/tbb.h>
+
+#if defined(WIN32) || defined(_WIN32)
+#define TO_STDSTR(qs)  (qs.toStdWString())
+#else
+#define TO_STDSTR(qs)  (qs.toStdString())
+#endif
+
+// --------------------------------------------------------
+//    ThumbnailLoader class
+// --------------------------------------------------------
+ThumbnailLoader::ThumbnailLoader(const QStringList& fileNames,
+                                 const QString& cacheDir,
+                                 QObject* parent)
+    : QThread(parent),
+      fileNames_(fileNames),
+      cacheDir_(cacheDir),
+      cancelled_(false)
+{
+}
+
+ThumbnailLoader::~ThumbnailLoader()
+{
+    cancel();
+    wait();
+}
+
+void ThumbnailLoader::run()
+{
+    tbb::parallel_for(0, int(fileNames_.size()), [this](int i)
+    {
+        if (cancelled_)
+            return;
+
+        QImage image = loadThumbnail(fileNames_.at(i));
+        if (!image.isNull() && !cancelled_)
+            Q_EMIT thumbnailReady(i, image);
+    });
+
+    // after the folder thumbnails are used so they are never trimmed
+    pruneCache();
+}
+
+// Removes the least recently used thumbnails once the cache grows over
+// the limit
+void ThumbnailLoader::pruneCache()
+{
+    if (cacheDir_.isEmpty())
+        return;
+
+    // cache hits touch the file so this is most recently used first
+    const auto thumbs = QDir(cacheDir_).entryInfoList(QStringList("*.png"), QDir::Files, QDir::Time);
+    const qint64 limit = qint64(THUMB_CACHE_MB) << 20;
+    qint64 used = 0;
+    for (const auto& thumb: thumbs)
+    {
+        used += thumb.size();
+        if (used > limit)
+            QFile::remove(thumb.absoluteFilePath());
+    }
+}
+
+QImage ThumbnailLoader::loadThumbnail(const QString& fileName)
+{
+    QFileInfo info(fileName);
+    QString key = info.absoluteFilePath() + "|" + QString::number(info.size()) + "|" +
+                  QString::number(info.lastModified().toMSecsSinceEpoch());
+    QString cacheFile = cacheDir_ + "/" +
+                        QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex()) +
+                        ".png";
+
+    QImage image;
+    if (!cacheDir_.isEmpty() && image.load(cacheFile))
+    {
+        QFile file(cacheFile);
+        if (file.open(QIODevice::ReadWrite))
+            file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        return image;
+    }
+
+    TIIQThumbnail thumbnail;
+    if (!readIIQThumbnail(TO_STDSTR(fileName), thumbnail))
+        return image;
+
+    image = QImage(thumbnail.rgb.data(), thumbnail.width, thumbnail.height,
+                   thumbnail.width*3, QImage::Format_RGB888).copy();
+    if (image.width() > THUMB_SIZE || image.height() > THUMB_SIZE)
+        image = image.scaled(THUMB_SIZE, THUMB_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    if (!cacheDir_.isEmpty())
+        image.save(cacheFile, "PNG");
+
+    return image;
+}
+
+// --------------------------------------------------------
+//    ThumbnailBrowser class
+// --------------------------------------------------------
+ThumbnailBrowser::ThumbnailBrowser(QWidget* parent)
+    : QDockWidget(tr("IIQ Files"), parent),
+      loader_(0),
+      thumbsPending_(false)
+{
+    setObjectName("thumbBrowser");
+
+    list_ = new QListWidget(this);
+    list_->setViewMode(QListView::IconMode);
+    list_->setIconSize(QSize(THUMB_SIZE, THUMB_SIZE));
+    list_->setGridSize(QSize(THUMB_SIZE+16, THUMB_SIZE+32));
+    list_->setResizeMode(QListView::Adjust);
+    list_->setMovement(QListView::Static);
+    list_->setUniformItemSizes(true);
+    list_->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    setWidget(list_);
+
+    connect(list_, SIGNAL(itemActivated(QListWidgetItem*)), this, SLOT(itemActivated(QListWidgetItem*)));
+    connect(this, SIGNAL(visibilityChanged(bool)), this, SLOT(panelVisible(bool)));
+}
+
+ThumbnailBrowser::~ThumbnailBrowser()
+{
+    stopLoader();
+}
+
+void ThumbnailBrowser::setFolder(const QString& folder)
+{
+    // same folder is rescanned for added or removed files
+    QString path = QDir(folder).absolutePath();
+    QStringList fileNames = folderRaws(path);
+    if (path == folder_ && fileNames == fileNames_)
+        return;
+
+    stopLoader();
+    folder_ = path;
+    fileNames_ = fileNames;
+
+    // placeholders until thumbnails are read
+    QPixmap blank(THUMB_SIZE, THUMB_SIZE*2/3);
+    blank.fill(Qt::darkGray);
+    QIcon blankIcon(blank);
+
+    list_->clear();
+    for (const auto& fileName: fileNames_)
+        new QListWidgetItem(blankIcon, QFileInfo(fileName).fileName(), list_);
+
+    thumbsPending_ = true;
+    if (isVisible())
+        loadThumbnails();
+}
+
+void ThumbnailBrowser::setCurrentFile(const QString& fileName)
+{
+    QFileInfo info(fileName);
+    setFolder(info.absolutePath());
+
+    int index = fileNames_.indexOf(info.absoluteFilePath());
+    if (index >= 0)
+    {
+        list_->setCurrentRow(index, QItemSelectionModel::ClearAndSelect);
+        list_->scrollToItem(list_->item(index));
+    }
+}
+
+void ThumbnailBrowser::loadThumbnails()
+{
+    thumbsPending_ = false;
+    if (fileNames_.isEmpty())
+        return;
+
+    QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!cacheDir.isEmpty())
+    {
+        cacheDir = QDir(cacheDir).filePath(THUMB_CACHE_DIR);
+        if (!QDir().mkpath(cacheDir))
+            cacheDir.clear();
+    }
+
+    loader_ = new ThumbnailLoader(fileNames_, cacheDir, this);
+    connect(loader_, SIGNAL(thumbnailReady(int,QImage)), this, SLOT(thumbnailReady(int,QImage)));
+    loader_->start(QThread::LowPriority);
+}
+
+void ThumbnailBrowser::stopLoader()
+{
+    if (loader_)
+    {
+        loader_->disconnect(this);
+        loader_->cancel();
+        loader_->wait();
+        loader_->deleteLater();
+        loader_ = 0;
+    }
+}
+
+void ThumbnailBrowser::thumbnailReady(int index, const QImage& image)
+{
+    // thumbnails of the previous folder are ignored
+    if (sender() != loader_ || index >= list_->count())
+        return;
+
+    list_->item(index)->setIcon(QIcon(QPixmap::fromImage(image)));
+}
+
+void ThumbnailBrowser::itemActivated(QListWidgetItem* item)
+{
+    // activated along with other selected ones for stacking
+    QStringList fileNames;
+    if (item->isSelected())
+    {
+        for (int i=0; i<list_->count(); ++i)
+            if (list_->item(i)->isSelected())
+                fileNames.append(fileNames_.at(i));
+    }
+    else
+        fileNames.append(fileNames_.at(list_->row(item)));
+
+    Q_EMIT rawsActivated(fileNames);
+}
+
+void ThumbnailBrowser::panelVisible(bool visible)
+{
+    if (visible && thumbsPending_)
+        loadThumbnails();
+}
@@ -0,0 +1,117 @@
+/*
+    thumb_browser.h - browser of IIQ files with thumbnails
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#ifndef IIQ_THUMB_BROWSER_H
+#define IIQ_THUMB_BROWSER_H
+
+#include <QDockWidget>
+#include <QImage>
+#include <QListWidget>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+
+#include <atomic>
+
+// Size of the thumbnail longer side
+#define THUMB_SIZE  160
+
+// Thumbnails cache folder under the user cache location
+#define THUMB_CACHE_DIR  "thumbnails"
+
+// Size the thumbnails cache is trimmed to in megabytes
+#define THUMB_CACHE_MB  64
+
+// ------------------------------
+//      ThumbnailLoader class
+// ------------------------------
+// Reads previews of IIQ files in parallel. Thumbnails are kept in the
+// cache folder keyed by file path, size and modification time, the
+// least recently used ones over THUMB_CACHE_MB are removed after loading.
+class ThumbnailLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+
+    ThumbnailLoader(const QStringList& fileNames,
+                    const QString& cacheDir,
+                    QObject* parent = 0);
+    ~ThumbnailLoader();
+
+    void cancel() { cancelled_ = true; }
+
+Q_SIGNALS:
+    // emitted from worker threads as thumbnails are ready
+    void thumbnailReady(int index, const QImage& image);
+
+protected:
+    void run();
+
+private:
+    QImage loadThumbnail(const QString& fileName);
+    void pruneCache();
+
+    QStringList fileNames_;
+    QString cacheDir_;
+    std::atomic<bool> cancelled_;
+};
+
+// ------------------------------
+//      ThumbnailBrowser class
+// ------------------------------
+// Dock panel with thumbnails of IIQ files in a folder. Activating
+// selected files requests loading them (more than one for a stack).
+class ThumbnailBrowser : public QDockWidget
+{
+    Q_OBJECT
+
+public:
+
+    ThumbnailBrowser(QWidget* parent = 0);
+    ~ThumbnailBrowser();
+
+    // shows IIQ files in the folder, thumbnails are read once visible
+    void setFolder(const QString& folder);
+
+    // shows the folder of the file and selects it
+    void setCurrentFile(const QString& fileName);
+
+Q_SIGNALS:
+    void rawsActivated(const QStringList& fileNames);
+
+private Q_SLOTS:
+    void thumbnailReady(int index, const QImage& image);
+    void itemActivated(QListWidgetItem* item);
+    void panelVisible(bool visible);
+
+private:
+    void loadThumbnails();
+    void stopLoader();
+
+    QListWidget* list_;
+    QString folder_;
+    QStringList fileNames_;
+    ThumbnailLoader* loader_;
+    bool thumbsPending_;
+};
+
+#endif
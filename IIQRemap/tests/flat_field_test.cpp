@@ -0,0 +1,94 @@
+/*
+    flat_field_test.cpp - fixed point flat field against the float one
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#include "iiqcal.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Synthetic raw rows and flat field grids
+#define TEST_WIDTH  1000
+#define TEST_ROWS   64
+#define TEST_GRIDS  16
+
+// Runs both versions over rows of random pixels with random grid
+// multipliers, returns the largest difference between them
+template <class CFA>
+static int maxDifference(std::mt19937& rng, unsigned nc, CFA cfa)
+{
+    std::uniform_int_distribution<int> pixelDist(0, 65535);
+    std::uniform_real_distribution<float> multDist(0.5f, 2.0f);
+    std::uniform_int_distribution<int> stepDist(8, 128);
+    std::uniform_int_distribution<int> startDist(0, 16);
+
+    int maxDiff = 0;
+    for (int grid = 0; grid < TEST_GRIDS; ++grid)
+    {
+        // header as read from calibration - start column, span and step
+        uint16_t head[8] = { 0 };
+        head[0] = startDist(rng);
+        head[2] = TEST_WIDTH - head[0] + stepDist(rng);
+        head[4] = stepDist(rng);
+        const unsigned wide = head[2] / head[4] + (head[2] % head[4] != 0);
+
+        std::vector<float> mrow(nc * wide);
+        for (auto& mult: mrow)
+            mult = multDist(rng);
+
+        for (unsigned row = 0; row < TEST_ROWS; ++row)
+        {
+            std::vector<uint16_t> pixels(TEST_WIDTH);
+            for (auto& pixel: pixels)
+                pixel = pixelDist(rng);
+            std::vector<uint16_t> fixed = pixels;
+
+            flatFieldRow(pixels.data(), TEST_WIDTH, head, wide, nc, mrow.data(), row, 0, cfa);
+            flatFieldRowFixed(fixed.data(), TEST_WIDTH, head, wide, nc, mrow.data(), row, 0, cfa);
+
+            for (unsigned col = 0; col < TEST_WIDTH; ++col)
+                maxDiff = std::max(maxDiff, std::abs(int(pixels[col]) - int(fixed[col])));
+        }
+    }
+    return maxDiff;
+}
+
+int main()
+{
+    static const unsigned patterns[] = {
+        CFA_PATTERN(0,1,3,2), CFA_PATTERN(1,0,2,3),
+        CFA_PATTERN(3,2,0,1), CFA_PATTERN(2,3,1,0) };
+
+    std::mt19937 rng(2021);
+    int result = EXIT_SUCCESS;
+    for (unsigned pattern: patterns)
+        for (unsigned nc: { 2u, 4u })
+            dispatchCFA(pattern, [&](auto cfa)
+            {
+                int maxDiff = maxDifference(rng, nc, cfa);
+                std::printf("pattern %02x, %u colours: max difference %d\n", pattern, nc, maxDiff);
+                if (maxDiff > 1)
+                    result = EXIT_FAILURE;
+            });
+
+    return result;
+}
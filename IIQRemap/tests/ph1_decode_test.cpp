@@ -0,0 +1,280 @@
+/*
+    ph1_decode_test.cpp - native Phase One decoders against LibRaw one
+
+    Copyright 2021 Alexey Danilchenko
+    Written by Alexey Danilchenko
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3, or (at your option)
+    any later version with ADDITION (see below).
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, 51 Franklin Street - Fifth Floor, Boston,
+    MA 02110-1301, USA.
+*/
+#include "iiqcal.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+
+// Synthetic raw rows - widths with and without a tail shorter than
+// a block of 8 pixels
+#define TEST_HEIGHT  150
+#define STRIP_OFFSET 16
+
+// Areas decoded with region decode and black level taken off them
+#define TEST_AREAS   20
+#define TEST_BLACK   50
+
+// Writes bits the way Phase One decoder reads them - most significant
+// first from little endian 32 bit words
+class TBitWriter
+{
+public:
+    TBitWriter(std::vector<uint8_t>& data): data_(data), word_(0), bits_(0) {}
+
+    void put(unsigned value, int n)
+    {
+        for (int i = n - 1; i >= 0; --i)
+        {
+            word_ = word_ << 1 | ((value >> i) & 1);
+            if (++bits_ == 32)
+                flush();
+        }
+    }
+
+    // pads the last word with zeros
+    void finish()
+    {
+        if (bits_)
+        {
+            word_ <<= 32 - bits_;
+            flush();
+        }
+    }
+
+private:
+    void flush()
+    {
+        for (int i = 0; i < 4; ++i)
+            data_.push_back(uint8_t(word_ >> (8*i)));
+        word_ = 0;
+        bits_ = 0;
+    }
+
+    std::vector<uint8_t>& data_;
+    uint32_t word_;
+    int bits_;
+};
+
+// Encodes random rows, some of them keeping code lengths of the
+// previous row, and returns the file with strip table and the data
+// with rows stored in shuffled order
+static std::vector<uint8_t> encodeRaw(std::mt19937& rng, unsigned width, unsigned height,
+                                      INT64& dataOffset)
+{
+    static const int length[] = { 8, 7, 6, 9, 11, 10, 5, 12, 14, 13 };
+    std::uniform_int_distribution<int> lenDist(0, 9);
+    std::uniform_int_distribution<int> pixelDist(0, 65535);
+    std::bernoulli_distribution keepDist(0.2);
+
+    std::vector<std::vector<uint8_t>> rows(height);
+    int len[2] = { 0, 0 };
+    for (unsigned row = 0; row < height; ++row)
+    {
+        TBitWriter bits(rows[row]);
+        int pred[2] = { 0, 0 };
+        for (unsigned col = 0; col < width; ++col)
+        {
+            if (col >= (width & -8))
+                len[0] = len[1] = 14;
+            else if ((col & 7) == 0)
+                for (int i = 0; i < 2; i++)
+                {
+                    // single set bit keeps the length, the first row sets it
+                    if (row > 0 && keepDist(rng))
+                    {
+                        bits.put(1, 1);
+                        continue;
+                    }
+                    int code = lenDist(rng);
+                    int zeros = code/2 + 1;
+                    bits.put(0, zeros);
+                    if (zeros < 5)
+                        bits.put(1, 1);
+                    bits.put(code & 1, 1);
+                    len[i] = length[code];
+                }
+
+            int& p = pred[col & 1];
+            int n = len[col & 1];
+            if (n == 14)
+            {
+                p = pixelDist(rng);
+                bits.put(p, 16);
+            }
+            else
+            {
+                // difference within the code range keeping the value valid
+                int lo = std::max(1 - (1 << (n - 1)), -p);
+                int hi = std::min(1 << (n - 1), 65535 - p);
+                int diff = std::uniform_int_distribution<int>(lo, hi)(rng);
+                bits.put(diff - 1 + (1 << (n - 1)), n);
+                p += diff;
+            }
+        }
+        bits.finish();
+    }
+
+    std::vector<unsigned> order(height);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+
+    std::vector<uint8_t> file(STRIP_OFFSET + 4*height, 0);
+    dataOffset = file.size();
+    for (unsigned row: order)
+    {
+        uint32_t offset = uint32_t(file.size() - dataOffset);
+        for (int i = 0; i < 4; ++i)
+            file[STRIP_OFFSET + 4*row + i] = uint8_t(offset >> (8*i));
+        file.insert(file.end(), rows[row].begin(), rows[row].end());
+    }
+    return file;
+}
+
+// Raw of the file decoded with either decoder or by areas with region
+// decode
+class TDecodeTest: public IIQFile
+{
+public:
+    TDecodeTest(const std::vector<uint8_t>& file, unsigned width, unsigned height,
+                int format, INT64 dataOffset)
+        : stream_(file.data(), file.size())
+    {
+        libraw_internal_data.internal_data.input = &stream_;
+        libraw_internal_data.unpacker_data.order = 0x4949;
+        libraw_internal_data.unpacker_data.strip_offset = STRIP_OFFSET;
+        libraw_internal_data.unpacker_data.data_offset = dataOffset;
+        libraw_internal_data.unpacker_data.data_error = 0;
+        imgdata.sizes.raw_width = width;
+        imgdata.sizes.raw_height = height;
+        imgdata.sizes.raw_pitch = width*sizeof(uint16_t);
+        imgdata.color.phase_one_data = ph1_t();
+        imgdata.color.phase_one_data.format = format;
+        imgdata.rawdata.raw_alloc = nullptr;
+        imgdata.rawdata.raw_image = nullptr;
+        imgdata.rawdata.ph1_cblack = nullptr;
+        imgdata.rawdata.ph1_rblack = nullptr;
+        imgdata.params.user_black = -1;
+        std::fill(std::begin(imgdata.params.user_cblack), std::end(imgdata.params.user_cblack), -1000001);
+        load_raw = &TDecodeTest::phase_one_load_raw_c;
+    }
+
+    ~TDecodeTest()
+    {
+        endRegionDecode();
+        libraw_internal_data.internal_data.input = nullptr;
+    }
+
+    std::vector<uint16_t> decode(bool native, bool& error)
+    {
+        std::vector<uint16_t> raw(size_t(imgdata.sizes.raw_width)*imgdata.sizes.raw_height, 0);
+        imgdata.rawdata.raw_image = raw.data();
+        if (native)
+            phase_one_load_raw_parallel();
+        else
+            phase_one_load_raw_c();
+        error = libraw_internal_data.unpacker_data.data_error != 0;
+        imgdata.rawdata.raw_image = nullptr;
+        return raw;
+    }
+
+    void setBlack(int black) { imgdata.color.phase_one_data.t_black = black; }
+
+private:
+    LibRaw_buffer_datastream stream_;
+};
+
+// Areas of the raw decoded with region decode against the whole raw,
+// returns number of pixels that differ and counts decoded areas
+static size_t checkRegions(std::mt19937& rng, const std::vector<uint8_t>& file, unsigned width,
+                           int format, INT64 dataOffset, const std::vector<uint16_t>& expected,
+                           int& decoded)
+{
+    TDecodeTest region(file, width, TEST_HEIGHT, format, dataOffset);
+    region.setBlack(TEST_BLACK);
+    decoded = 0;
+    if (!region.beginRegionDecode(IIQCalFile(), false, false))
+        return 0;
+
+    size_t diffs = 0;
+    for (int i = 0; i < TEST_AREAS; ++i)
+    {
+        TRawRect area;
+        area.col = std::uniform_int_distribution<int>(0, width - 1)(rng);
+        area.row = std::uniform_int_distribution<int>(0, TEST_HEIGHT - 1)(rng);
+        area.width = std::uniform_int_distribution<int>(1, width - area.col)(rng);
+        area.height = std::uniform_int_distribution<int>(1, TEST_HEIGHT - area.row)(rng);
+
+        std::vector<uint16_t> pixels;
+        if (!region.decodeRegion(area, pixels))
+            continue;
+
+        ++decoded;
+        for (int row = 0; row < area.height; ++row)
+            for (int col = 0; col < area.width; ++col)
+            {
+                int value = expected[size_t(area.row + row)*width + area.col + col] - TEST_BLACK;
+                diffs += pixels[size_t(row)*area.width + col] != std::max(value, 0);
+            }
+    }
+    return diffs;
+}
+
+int main()
+{
+    std::mt19937 rng(2021);
+    int result = EXIT_SUCCESS;
+    for (unsigned width: { 203u, 200u, 7u })
+        for (int format: { 1, 5, 8 })
+        {
+            INT64 dataOffset = 0;
+            auto file = encodeRaw(rng, width, TEST_HEIGHT, dataOffset);
+
+            TDecodeTest libRaw(file, width, TEST_HEIGHT, format, dataOffset);
+            TDecodeTest native(file, width, TEST_HEIGHT, format, dataOffset);
+            bool libRawError = false, nativeError = false;
+            auto expected = libRaw.decode(false, libRawError);
+            auto decoded = native.decode(true, nativeError);
+
+            size_t diffs = 0;
+            for (size_t i = 0; i < expected.size(); ++i)
+                diffs += expected[i] != decoded[i];
+
+            // rows keeping code lengths of the previous row can only be
+            // decoded on their own when rows end with a part block
+            int areas = 0;
+            size_t areaDiffs = checkRegions(rng, file, width, format, dataOffset, expected, areas);
+
+            std::printf("width %u, format %d: %zu pixels differ, errors %d/%d, "
+                        "%d/%d areas decoded with %zu pixels differing\n",
+                        width, format, diffs, libRawError, nativeError,
+                        areas, TEST_AREAS, areaDiffs);
+            if (diffs || libRawError || nativeError || areaDiffs ||
+                ((width & 7) && areas != TEST_AREAS))
+                result = EXIT_FAILURE;
+        }
+
+    return result;
+}